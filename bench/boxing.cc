@@ -0,0 +1,102 @@
+#include "runtime/value.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+// Measures the cost of storing a number in a `Value` and reading it back.
+// Doubles are NaN-boxed, and compared against boxing them on the heap, which
+// is what a tagged pointer representation has to do for them.
+
+#define ITERATIONS 10000000
+#define RUNS 5
+
+namespace Verve {
+
+class BoxingBenchmark {
+  public:
+
+  // runs an iteration and returns a value that depends on it, so the
+  // compiler can't drop it. Every iteration costs the same indirect call
+  typedef uint64_t (*Iteration)(unsigned);
+
+  BoxingBenchmark(const char *name) :
+    m_name(name) {}
+
+  void run(Iteration iteration) {
+    m_iteration = iteration;
+    uint64_t sink = 0;
+    double best = 0;
+    for (unsigned i = 0; i < RUNS; i++) {
+      auto start = std::chrono::high_resolution_clock::now();
+      for (unsigned j = 0; j < ITERATIONS; j++) {
+        sink += m_iteration(j);
+      }
+      auto end = std::chrono::high_resolution_clock::now();
+      double ns = std::chrono::duration<double, std::nano>(end - start).count();
+      best = i ? std::min(best, ns) : ns;
+    }
+    s_sink = sink;
+    printf("%-32s %6.2f ns/op\n", m_name, best / ITERATIONS);
+  }
+
+  private:
+
+  const char *m_name;
+  // called through a volatile pointer, so it isn't inlined into the loop
+  Iteration volatile m_iteration;
+  static volatile uint64_t s_sink;
+};
+
+volatile uint64_t BoxingBenchmark::s_sink;
+
+static uint64_t intRoundTrip(unsigned i) {
+  auto value = Value::decode(Value((int)i).encode());
+  return value.isInt() ? value.asInt() : 0;
+}
+
+static uint64_t doubleRoundTrip(unsigned i) {
+  auto value = Value::decode(Value(i * 0.5).encode());
+  return value.isDouble() ? (uint64_t)value.asDouble() : 0;
+}
+
+// a double in an object of its own, freed right away as a GC would
+// eventually do
+static uint64_t heapDoubleRoundTrip(unsigned i) {
+  auto object = (Object *)malloc(sizeof(Object) + sizeof(double));
+  object->tag = 0;
+  object->size = 1;
+  *(double *)(object + 1) = i * 0.5;
+
+  auto value = Value::decode(Value(object).encode());
+  uint64_t result = value.isObject() ? (uint64_t)*(double *)(value.asObject() + 1) : 0;
+  free(object);
+  return result;
+}
+
+static uint64_t doubleAdd(unsigned i) {
+  auto lhs = Value::decode(Value(i * 0.5).encode());
+  auto rhs = Value::decode(Value(1.5).encode());
+  return Value(lhs.asDouble() + rhs.asDouble()).encode();
+}
+
+static uint64_t pointerTagTest(unsigned i) {
+  static List list = { 0 };
+  auto value = Value::decode(i & 1 ? Value(&list).encode() : Value((int)i).encode());
+  return value.isList() ? (uint64_t)value.asList()->length : value.isHeapAllocated();
+}
+
+}
+
+int main() {
+  using namespace Verve;
+
+  BoxingBenchmark("int").run(intRoundTrip);
+  BoxingBenchmark("double (NaN-boxed)").run(doubleRoundTrip);
+  BoxingBenchmark("double (heap-boxed)").run(heapDoubleRoundTrip);
+  BoxingBenchmark("double add (NaN-boxed)").run(doubleAdd);
+  BoxingBenchmark("pointer tag test").run(pointerTagTest);
+
+  return 0;
+}
@@ -0,0 +1,177 @@
+#include "bytecode/opcodes.h"
+#include "bytecode/sections.h"
+#include "runtime/vm.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <sstream>
+
+// Measures the cost of dispatching a single opcode through each interpreter
+// engine. Each benchmark is a straight line of `ITERATIONS` copies of a short
+// opcode sequence, so the numbers are comparable across platforms.
+
+#define ITERATIONS 1000000
+#define RUNS 5
+
+namespace Verve {
+
+class DispatchBenchmark {
+  public:
+
+  typedef std::function<void(DispatchBenchmark &)> Emitter;
+
+  DispatchBenchmark(const char *name, unsigned opsPerIteration) :
+    m_name(name),
+    m_opsPerIteration(opsPerIteration) {}
+
+  void emitOpcode(Opcode::Type opcode) {
+    write(opcode);
+  }
+
+  void write(int64_t data) {
+    m_output.write(reinterpret_cast<char *>(&data), sizeof(data));
+  }
+
+  void run(Emitter iteration, Emitter prologue = nullptr) {
+    printf("%-24s", m_name);
+    for (auto engine : { Engine::Asm, Engine::Cxx }) {
+      printf(" %6.2f ns/op (%s)", measure(engine, iteration, prologue), typeName(engine));
+    }
+    printf("\n");
+  }
+
+  private:
+
+  double measure(Engine engine, Emitter iteration, Emitter prologue) {
+    m_output = std::stringstream();
+
+    // header, version, encoding, and the table of contents of the 2 sections
+    const int64_t strings = 10 * WORD_SIZE;
+    const int64_t text = strings + 3 * WORD_SIZE;
+    write(Section::Header);
+    write(Section::Version);
+    write(Section::Wide);
+    write(2);
+    write(Section::Strings);
+    write(strings);
+    write(text - strings);
+    write(Section::Text);
+    write(text);
+    write(0); // filled in once the code is emitted
+
+    write(1); // number of strings
+    write(WORD_SIZE * 2); // offset of "print"
+    m_output << "print";
+    m_output.put(0);
+
+    unsigned index = m_output.tellp();
+    while (index++ % WORD_SIZE) {
+      m_output.put(1);
+    }
+
+    write(2); // lookup table size
+    write(0); // call caches
+
+    if (prologue) {
+      prologue(*this);
+    }
+    for (unsigned i = 0; i < ITERATIONS; i++) {
+      iteration(*this);
+    }
+    emitOpcode(Opcode::exit);
+
+    int64_t end = m_output.tellp();
+    m_output.seekp(9 * WORD_SIZE);
+    write(end - text);
+
+    auto bytecode = m_output.str();
+    double best = 0;
+    for (unsigned i = 0; i < RUNS; i++) {
+      VM vm((const uint8_t *)&bytecode[0], bytecode.size(), engine);
+      auto start = std::chrono::high_resolution_clock::now();
+      vm.execute();
+      auto end = std::chrono::high_resolution_clock::now();
+      double ns = std::chrono::duration<double, std::nano>(end - start).count();
+      best = i ? std::min(best, ns) : ns;
+    }
+    return best / ((double)ITERATIONS * m_opsPerIteration);
+  }
+
+  const char *m_name;
+  unsigned m_opsPerIteration;
+  std::stringstream m_output;
+};
+
+static void pushJz(DispatchBenchmark &b) {
+  b.emitOpcode(Opcode::push);
+  b.write(1);
+  b.emitOpcode(Opcode::jz);
+  b.write(0);
+}
+
+static void lookupJz(DispatchBenchmark &b) {
+  b.emitOpcode(Opcode::lookup);
+  b.write(0); // $print
+  b.write(1); // cache slot
+  b.emitOpcode(Opcode::jz);
+  b.write(0);
+}
+
+static void stackLoadJz(DispatchBenchmark &b) {
+  b.emitOpcode(Opcode::stack_load);
+  b.write(0);
+  b.emitOpcode(Opcode::jz);
+  b.write(0);
+}
+
+// the sum is never zero, so `jz` only pops it
+static void addI32Jz(DispatchBenchmark &b) {
+  b.emitOpcode(Opcode::push);
+  b.write(1);
+  b.emitOpcode(Opcode::push);
+  b.write(2);
+  b.emitOpcode(Opcode::add_i32);
+  b.emitOpcode(Opcode::jz);
+  b.write(0);
+}
+
+static void addF64Jz(DispatchBenchmark &b) {
+  b.emitOpcode(Opcode::push);
+  b.write(Value(1.5).encode());
+  b.emitOpcode(Opcode::push);
+  b.write(Value(2.5).encode());
+  b.emitOpcode(Opcode::add_f64);
+  b.emitOpcode(Opcode::jz);
+  b.write(0);
+}
+
+static void jmp(DispatchBenchmark &b) {
+  b.emitOpcode(Opcode::jmp);
+  b.write(2 * WORD_SIZE);
+}
+
+static void stackLoadPrologue(DispatchBenchmark &b) {
+  b.emitOpcode(Opcode::stack_alloc);
+  b.write(WORD_SIZE);
+  b.emitOpcode(Opcode::push);
+  b.write(1);
+  b.emitOpcode(Opcode::stack_store);
+  b.write(0);
+}
+
+}
+
+int main() {
+  using namespace Verve;
+
+  DispatchBenchmark("push + jz", 2).run(pushJz);
+  DispatchBenchmark("lookup (cached) + jz", 2).run(lookupJz);
+  DispatchBenchmark("stack_load + jz", 2).run(stackLoadJz, stackLoadPrologue);
+  DispatchBenchmark("push x2 + add_i32 + jz", 4).run(addI32Jz);
+  DispatchBenchmark("push x2 + add_f64 + jz", 4).run(addF64Jz);
+  DispatchBenchmark("jmp", 1).run(jmp);
+
+  return 0;
+}
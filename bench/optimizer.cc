@@ -0,0 +1,141 @@
+#include "bytecode/generator.h"
+#include "parser/lexer.h"
+#include "parser/optimizer.h"
+#include "parser/parser.h"
+#include "runtime/opcode_profile.h"
+#include "runtime/vm.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <glob.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Runs every program in `tests/` compiled at -O0 and at the default level,
+// and compares the size of their bytecode, the number of instructions they
+// execute and how long they take to run on the assembly engine, best of
+// `RUNS`. Their output is discarded.
+
+#define RUNS 3
+
+namespace Verve {
+
+struct Measurement {
+  size_t size;
+  uint64_t executed;
+  double ms;
+
+  void add(const Measurement &other) {
+    size += other.size;
+    executed += other.executed;
+    ms += other.ms;
+  }
+};
+
+// Compiles and runs the program once. The runtime keeps global state, like
+// its table of strings, so every run happens in a process of its own.
+// Instructions are counted by the C++ engine, without superinstructions.
+static Measurement run(const char *filename, unsigned level, bool countInstructions) {
+  int channel[2];
+  pipe(channel);
+
+  fflush(stdout);
+  if (fork() == 0) {
+    FILE *source = fopen(filename, "r");
+    fseek(source, 0, SEEK_END);
+    size_t sourceSize = ftell(source);
+    fseek(source, 0, SEEK_SET);
+
+    char *input = (char *)malloc(sourceSize + 1);
+    fread(input, 1, sourceSize, source);
+    input[sourceSize] = '\0';
+    fclose(source);
+
+    Lexer lexer(filename, input);
+    Parser parser(lexer, "tests");
+    auto ast = parser.parse();
+
+    Optimizer optimizer(ast, level);
+    optimizer.optimize();
+
+    Generator generator(ast);
+    generator.m_useSuperinstructions = !countInstructions;
+    generator.m_usePeephole = level >= 1;
+    auto bytecode = generator.generate().str();
+
+    freopen("/dev/null", "w", stdout);
+    OpcodeProfile profile;
+    VM vm((const uint8_t *)&bytecode[0], bytecode.size(), countInstructions ? Engine::Cxx : Engine::Asm);
+    if (countInstructions) {
+      vm.m_profile = &profile;
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    vm.execute();
+    auto end = std::chrono::high_resolution_clock::now();
+    fflush(stdout);
+
+    Measurement measurement {
+      bytecode.size(),
+      profile.executed(),
+      std::chrono::duration<double, std::milli>(end - start).count()
+    };
+    write(channel[1], &measurement, sizeof(measurement));
+    _exit(0);
+  }
+
+  Measurement measurement {};
+  read(channel[0], &measurement, sizeof(measurement));
+  wait(nullptr);
+  close(channel[0]);
+  close(channel[1]);
+  return measurement;
+}
+
+static Measurement measure(const char *filename, unsigned level) {
+  Measurement best = run(filename, level, false);
+  for (unsigned i = 1; i < RUNS; i++) {
+    best.ms = std::min(best.ms, run(filename, level, false).ms);
+  }
+  best.executed = run(filename, level, true).executed;
+  return best;
+}
+
+static void print(const char *name, Measurement &unoptimized, Measurement &optimized) {
+  printf("%-32s %6zu -> %6zu bytes %11llu -> %11llu instructions %9.3f -> %9.3f ms\n",
+      name,
+      unoptimized.size, optimized.size,
+      (unsigned long long)unoptimized.executed, (unsigned long long)optimized.executed,
+      unoptimized.ms, optimized.ms);
+}
+
+}
+
+int main() {
+  using namespace Verve;
+
+  ROOT_DIR = ".";
+
+  printf("-O0 -> -O%u\n", Optimizer::DefaultLevel);
+
+  glob_t programs;
+  glob("tests/*.vrv", 0, nullptr, &programs);
+
+  Measurement total[2] = {};
+  for (size_t i = 0; i < programs.gl_pathc; i++) {
+    auto filename = programs.gl_pathv[i];
+    auto unoptimized = measure(filename, 0);
+    auto optimized = measure(filename, Optimizer::DefaultLevel);
+
+    print(filename, unoptimized, optimized);
+
+    total[0].add(unoptimized);
+    total[1].add(optimized);
+  }
+  globfree(&programs);
+
+  print("total", total[0], total[1]);
+
+  return 0;
+}
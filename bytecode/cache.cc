@@ -0,0 +1,221 @@
+#include "cache.h"
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Verve {
+
+  // Entries are made of 8-byte words, so the bytecode at the end of the
+  // mapping is aligned as the VM expects:
+  //   magic (4 bytes), version (4 bytes), front end time (double)
+  //   number of dependencies
+  //   for each: hash, length of the path, path padded to a word
+  //   size of the bytecode, bytecode
+
+  static void writeWord(std::ostream &output, uint64_t word) {
+    output.write(reinterpret_cast<char *>(&word), sizeof(word));
+  }
+
+  static size_t padded(size_t size) {
+    return (size + 7) & ~(size_t)7;
+  }
+
+  static bool hashFile(const std::string &path, uint64_t &hash) {
+    std::ifstream file(path, std::ios_base::binary);
+    if (!file) {
+      return false;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    auto data = contents.str();
+    hash = BytecodeCache::hash(data.data(), data.size());
+    return true;
+  }
+
+  static double since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  // 64-bit FNV-1a
+  uint64_t BytecodeCache::hash(const char *data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325;
+    for (size_t i = 0; i < size; i++) {
+      hash ^= (uint8_t)data[i];
+      hash *= 0x100000001B3;
+    }
+    return hash;
+  }
+
+  std::string BytecodeCache::directory() {
+    auto cache = getenv("XDG_CACHE_HOME");
+    if (cache && *cache) {
+      return std::string(cache) + "/verve";
+    }
+    auto home = getenv("HOME");
+    if (home && *home) {
+      return std::string(home) + "/.cache/verve";
+    }
+    return "";
+  }
+
+  BytecodeCache::BytecodeCache(const std::string &filename, const std::string &configuration) {
+    auto directory = BytecodeCache::directory();
+    if (directory.empty()) {
+      return;
+    }
+
+    auto key = filename + '\0' + configuration;
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash(key.data(), key.size()));
+    m_path = directory + "/" + name + ".vrvc";
+  }
+
+  BytecodeCache::~BytecodeCache() {
+    if (m_entry) {
+      munmap(m_entry, m_entrySize);
+    }
+  }
+
+  const uint8_t *BytecodeCache::lookup(size_t &size) {
+    if (m_path.empty()) {
+      return NULL;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int fd = open(m_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) || info.st_size < 4 * 8) {
+      close(fd);
+      return NULL;
+    }
+    m_entrySize = info.st_size;
+    m_entry = mmap(NULL, m_entrySize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m_entry == MAP_FAILED) {
+      m_entry = NULL;
+      return NULL;
+    }
+
+    auto words = (const uint64_t *)m_entry;
+    auto end = words + m_entrySize / 8;
+    auto header = (const uint32_t *)words;
+    if (header[0] != Magic || header[1] != Version) {
+      return NULL;
+    }
+    double frontEnd;
+    memcpy(&frontEnd, words + 1, sizeof(frontEnd));
+
+    auto dependencies = words[2];
+    words += 3;
+    for (uint64_t i = 0; i < dependencies; i++) {
+      if (end - words < 2) {
+        return NULL;
+      }
+      auto expected = words[0];
+      auto length = words[1];
+      auto path = (const char *)(words + 2);
+      if ((uint64_t)((const char *)end - path) < padded(length)) {
+        return NULL;
+      }
+      uint64_t actual;
+      if (!hashFile(std::string(path, length), actual) || actual != expected) {
+        return NULL;
+      }
+      words += 2 + padded(length) / 8;
+    }
+
+    if (end - words < 1 || (uint64_t)((const uint8_t *)m_entry + m_entrySize - (const uint8_t *)(words + 1)) < words[0]) {
+      return NULL;
+    }
+    size = words[0];
+
+    m_hit = true;
+    m_lookup = since(start);
+    m_frontEnd = frontEnd;
+    return (const uint8_t *)(words + 1);
+  }
+
+  // Written to a temporary file first, so a concurrent run never maps a
+  // partial entry
+  void BytecodeCache::store(const std::string &bytecode, const std::vector<std::string> &dependencies, double frontEnd) {
+    m_frontEnd = frontEnd;
+    if (m_path.empty()) {
+      return;
+    }
+
+    // creates the directory and its parents, ignoring the ones that exist
+    auto directory = m_path.substr(0, m_path.rfind('/'));
+    for (size_t slash = 1; slash != std::string::npos;) {
+      slash = directory.find('/', slash + 1);
+      auto parent = directory.substr(0, slash);
+      if (mkdir(parent.c_str(), 0755) && errno != EEXIST) {
+        return;
+      }
+    }
+
+    // imports are read relative to the directory of the program, but the
+    // entry may be looked up from anywhere
+    std::vector<std::pair<std::string, uint64_t>> files;
+    for (auto &path : dependencies) {
+      char resolved[PATH_MAX];
+      uint64_t hash;
+      if (!realpath(path.c_str(), resolved) || !hashFile(resolved, hash)) {
+        return;
+      }
+      files.push_back({ resolved, hash });
+    }
+
+    auto temporary = m_path + "." + std::to_string(getpid());
+    {
+      std::ofstream output(temporary, std::ios_base::binary);
+      if (!output) {
+        return;
+      }
+
+      uint32_t header[2] = { Magic, Version };
+      output.write(reinterpret_cast<char *>(header), sizeof(header));
+      output.write(reinterpret_cast<char *>(&frontEnd), sizeof(frontEnd));
+
+      writeWord(output, files.size());
+      for (auto &file : files) {
+        auto &path = file.first;
+        writeWord(output, file.second);
+        writeWord(output, path.size());
+        output << path;
+        for (auto i = path.size(); i < padded(path.size()); i++) {
+          output.put(0);
+        }
+      }
+
+      writeWord(output, bytecode.size());
+      output << bytecode;
+      if (!output) {
+        output.close();
+        unlink(temporary.c_str());
+        return;
+      }
+    }
+    rename(temporary.c_str(), m_path.c_str());
+  }
+
+  void BytecodeCache::printStats(FILE *out) {
+    if (m_hit) {
+      fprintf(out, "bytecode cache: hit, saved %.2f ms (lookup took %.2f ms)\n", m_frontEnd - m_lookup, m_lookup);
+    } else {
+      fprintf(out, "bytecode cache: miss, front end took %.2f ms\n", m_frontEnd);
+    }
+  }
+
+}
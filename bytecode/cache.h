@@ -0,0 +1,48 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#pragma once
+
+namespace Verve {
+
+  // Bytecode of the programs run from source, saved in
+  // $XDG_CACHE_HOME/verve (~/.cache/verve by default). An entry is keyed by
+  // the path of the program and by `configuration`, the flags that change
+  // the bytecode and the build of verve that generated it. It lists the
+  // files the program was compiled from, the program itself, the prelude
+  // and its imports, with a hash of their contents, and is only used while
+  // none of them has changed.
+  class BytecodeCache {
+    public:
+      BytecodeCache(const std::string &filename, const std::string &configuration);
+      ~BytecodeCache();
+
+      // maps a valid entry read-only and returns its bytecode, or NULL
+      const uint8_t *lookup(size_t &size);
+
+      // `frontEnd` is the time it took to generate the bytecode, in ms,
+      // reported as saved by the runs that hit the entry
+      void store(const std::string &bytecode, const std::vector<std::string> &dependencies, double frontEnd);
+
+      void printStats(FILE *);
+
+      static uint64_t hash(const char *data, size_t size);
+      static std::string directory();
+
+      static const uint32_t Magic = 0x43565256; // "VRVC"
+      static const uint32_t Version = 1;
+
+    private:
+      std::string m_path;
+      void *m_entry = NULL;
+      size_t m_entrySize = 0;
+      bool m_hit = false;
+      // front end time saved by a hit, or spent by a miss
+      double m_frontEnd = 0;
+      double m_lookup = 0;
+  };
+
+}
@@ -0,0 +1,67 @@
+#include "compact.h"
+
+#include "peephole.h"
+
+#include <cassert>
+
+namespace Verve {
+
+  // Jump offsets are relative to the opcode of the jump, as in the wide
+  // encoding
+  static void encodeInstruction(std::string &output, const Instruction &instruction, const std::vector<int64_t> &jumpOffsets) {
+    assert(instruction.opcode < 0x100);
+    output.push_back((char)instruction.opcode);
+
+    if (instruction.opcode == Opcode::switch_tag) {
+      CompactEncoding::writeOperand(output, instruction.operands[0]);
+    } else if (!Peephole::isJump(instruction.opcode)) {
+      for (auto operand : instruction.operands) {
+        CompactEncoding::writeOperand(output, operand);
+      }
+    }
+    for (auto offset : jumpOffsets) {
+      CompactEncoding::writeOperand(output, offset, CompactEncoding::JumpSize);
+    }
+  }
+
+  std::string CompactEncoding::encode(const std::string &code) {
+    // superinstructions keep the operands of their first component, so
+    // decoding them only needs the size of their opcode
+    Peephole decoder(code, 0);
+    auto &instructions = decoder.instructions();
+
+    std::vector<int64_t> positions;
+    std::string output;
+    for (auto &instruction : instructions) {
+      positions.push_back(output.size());
+      encodeInstruction(output, instruction, std::vector<int64_t>(instruction.targets.size(), 0));
+    }
+    positions.push_back(output.size());
+
+    output.clear();
+    for (size_t i = 0; i < instructions.size(); i++) {
+      std::vector<int64_t> offsets;
+      for (auto target : instructions[i].targets) {
+        offsets.push_back(positions[target] - positions[i]);
+      }
+      encodeInstruction(output, instructions[i], offsets);
+    }
+    return output;
+  }
+
+  void CompactEncoding::writeOperand(std::string &output, int64_t value, unsigned size) {
+    for (unsigned i = 1;; i++) {
+      uint8_t byte = value & 0x7F;
+      // arithmetic shift, so negative values end in -1
+      value >>= 7;
+      bool done = (value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40));
+      if (done && i >= size) {
+        output.push_back(byte);
+        return;
+      }
+      output.push_back(byte | 0x80);
+      assert(!size || i < size);
+    }
+  }
+
+}
@@ -0,0 +1,53 @@
+#include "utils/macros.h"
+
+#include <cstdint>
+#include <string>
+
+#pragma once
+
+namespace Verve {
+
+  // The compact encoding of the code, an alternative to the default (wide)
+  // encoding of a word per opcode and per operand: opcodes take a byte, and
+  // operands are signed LEB128, so the offsets, slots and small constants
+  // most operands hold take a byte instead of a word. The operands of `jz`
+  // and `jmp`, and the entries of the table of a `switch_tag`, are padded to
+  // `JumpSize` bytes, so the code can be laid out before the offsets of the
+  // jumps are known. Only the C++ engine runs it.
+  class CompactEncoding {
+    public:
+      static const unsigned JumpSize = 5;
+
+      // `code` is the wide encoding of the code of a function or of the
+      // text, as emitted by the generator, and jumps don't leave it
+      static std::string encode(const std::string &code);
+
+      // pads the operand to `size` bytes if given
+      static void writeOperand(std::string &output, int64_t value, unsigned size = 0);
+
+      ALWAYS_INLINE static int64_t readOperand(const uint8_t *&p) {
+        if (!(*p & 0x80)) {
+          // sign extends the 7 bits of the operand
+          return (int8_t)(*p++ << 1) >> 1;
+        }
+
+        uint64_t result = 0;
+        unsigned shift = 0;
+        uint8_t byte;
+        do {
+          byte = *p++;
+          result |= (uint64_t)(byte & 0x7F) << shift;
+          shift += 7;
+        } while (byte & 0x80);
+        if (shift < 64 && (byte & 0x40)) {
+          result |= ~(uint64_t)0 << shift;
+        }
+        return result;
+      }
+
+      ALWAYS_INLINE static void skipOperand(const uint8_t *&p) {
+        while (*p++ & 0x80);
+      }
+  };
+
+}
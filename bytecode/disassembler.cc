@@ -4,6 +4,7 @@
 #include <iomanip>
 
 #include "disassembler.h"
+#include "compact.h"
 
 namespace Verve {
   Disassembler::Disassembler(std::stringstream &bytecode):
@@ -14,11 +15,15 @@ namespace Verve {
   }
 
   Disassembler::HelperStream Disassembler::write(int offset) {
+    return writeAt((int)m_bytecode.tellg() - (offset * WORD_SIZE));
+  }
+
+  Disassembler::HelperStream Disassembler::writeAt(int position) {
     std::cout
       << "["
       << std::setfill(' ')
       << std::setw(m_width)
-      << ((int)m_bytecode.tellg() - (offset * WORD_SIZE))
+      << position
       << "] "
       << m_padding;
 
@@ -31,6 +36,32 @@ namespace Verve {
     return value;
   }
 
+  Opcode::Type Disassembler::readOpcode() {
+    auto opcode = m_encoding == Section::Compact ? m_bytecode.get() : read();
+    m_opcodeEnd = m_bytecode.tellg();
+    return static_cast<Opcode::Type>(opcode);
+  }
+
+  int64_t Disassembler::readOperand() {
+    if (m_encoding != Section::Compact) {
+      return read();
+    }
+
+    uint8_t bytes[10] = {};
+    auto start = m_bytecode.tellg();
+    m_bytecode.read(reinterpret_cast<char *>(bytes), sizeof(bytes));
+    m_bytecode.clear();
+    const uint8_t *p = bytes;
+    auto value = CompactEncoding::readOperand(p);
+    m_bytecode.seekg(start + (std::streamoff)(p - bytes));
+    return value;
+  }
+
+  // instructions are printed at the position that follows their opcode
+  Disassembler::HelperStream Disassembler::writeInstruction() {
+    return writeAt(m_opcodeEnd);
+  }
+
   std::string Disassembler::readStr() {
     std::stringstream dest;
     m_bytecode.get(*dest.rdbuf(), '\0');
@@ -40,122 +71,143 @@ namespace Verve {
   }
 
   int Disassembler::calculateJmpTarget(int target) {
-    return (int)m_bytecode.tellg() - WORD_SIZE + target;
+    return (int)m_opcodeEnd + target;
   }
 
   void Disassembler::dump() {
     auto verve = read();
     assert(verve == Section::Header);
+    auto version = read();
+    assert(version == Section::Version);
+    m_encoding = (Section::Encoding)read();
+
+    auto sections = read();
+    for (int i = 0; i < sections; i++) {
+      auto type = read();
+      auto offset = read();
+      auto length = read();
+      m_sections[type] = { offset, length };
+    }
 
     dumpStrings();
     dumpFunctions();
     dumpText();
-
-    assert(m_bytecode.eof());
   }
 
   void Disassembler::dumpStrings() {
-    auto header = read();
-    if (header != Section::Strings) {
-      m_bytecode.seekg(-sizeof(header), m_bytecode.cur);
+    if (!m_sections.count(Section::Strings)) {
       return;
     }
 
+    auto start = m_sections[Section::Strings].first;
+    m_bytecode.seekg(start);
+    auto count = read();
+
     m_padding = "";
-    write(2) << "STRINGS:";
+    write(1) << "STRINGS:";
     m_padding = "  ";
 
-    unsigned str_index = 0;
-    while (true) {
-      auto verve = read();
-      if (verve == Section::Header)  {
-        return;
-      }
-      m_bytecode.seekg(-sizeof(verve), m_bytecode.cur);
-      auto p = m_bytecode.tellg();
+    std::vector<int64_t> offsets;
+    for (int i = 0; i < count; i++) {
+      offsets.push_back(read());
+    }
+    for (int i = 0; i < count; i++) {
+      m_bytecode.seekg(start + offsets[i]);
       auto str = readStr();
-      while (m_bytecode.peek() == '\1') {
-        m_bytecode.get();
-      }
       m_strings.push_back(str);
-      write((float)(m_bytecode.tellg() - p)/WORD_SIZE) <<  "$" << str_index++ << ": " << str;
+      m_bytecode.seekg(start + offsets[i]);
+      write() << "$" << i << ": " << str;
     }
   }
 
   void Disassembler::dumpFunctions() {
-    auto header = read();
-    if (header != Section::Functions) {
-      m_bytecode.seekg(-sizeof(header), m_bytecode.cur);
+    if (!m_sections.count(Section::Functions)) {
       return;
     }
 
+    m_bytecode.seekg(m_sections[Section::Functions].first);
+    auto count = read();
+
     m_padding = "";
     write(1) << "FUNCTIONS:";
-    m_padding = "  ";
 
-    while (true) {
-      auto header = read();
-      if (header == Section::Header) {
-        return;
+    // the whole table is read first, so calls print the name of the function
+    // they call
+    std::vector<std::vector<int64_t>> entries;
+    for (int i = 0; i < count; i++) {
+      std::vector<int64_t> entry;
+      for (unsigned j = 0; j < Section::FunctionEntrySize; j++) {
+        entry.push_back(read());
       }
-      assert(header == Section::FunctionHeader);
-
-      auto fnID = read();
-      auto argCount = read();
-
-      m_functions.push_back(m_strings[fnID]);
+      m_functions.push_back(m_strings[entry[0]]);
+      entries.push_back(entry);
+    }
+    std::vector<int64_t> argNames;
+    auto argsEnd = m_sections[Section::Functions].first + m_sections[Section::Functions].second;
+    while (m_bytecode.tellg() < argsEnd) {
+      argNames.push_back(read());
+    }
 
+    for (auto &entry : entries) {
+      auto name = m_strings[entry[0]];
+      auto argCount = entry[1];
       std::stringstream args;
       for (int i = 0; i < argCount; i++) {
-        auto argID = read();
         if (i) args << ", ";
-        args << "$" << i << ": " << m_strings[argID];
+        args << "$" << i << ": " << m_strings[argNames[entry[2] + i]];
       }
 
+      m_bytecode.seekg(entry[3]);
       m_padding = "";
-      write(2 + argCount) << m_strings[fnID] << "(" << args.str() << "):";
+      write() << name << "(" << args.str() << "):";
       m_padding = "  ";
 
-      while (true) {
-        auto header = read();
-        m_bytecode.seekg(-sizeof(header), m_bytecode.cur);
-        if (header == Section::FunctionHeader || header == Section::Header) {
-          break;
-        }
-
-        auto opcode = read();
-        printOpcode(static_cast<Opcode::Type>(opcode));
+      auto end = entry[3] + entry[4];
+      while (m_bytecode.tellg() < end) {
+        printOpcode(readOpcode());
       }
     }
   }
 
   void Disassembler::dumpText() {
-    auto header = read();
-    if (header != Section::Text) {
-      m_bytecode.seekg(-sizeof(header), m_bytecode.cur);
+    if (!m_sections.count(Section::Text)) {
       return;
     }
 
+    auto start = m_sections[Section::Text].first;
+    m_bytecode.seekg(start);
+
     m_padding = "";
-    write(1) << "TEXT:";
+    write() << "TEXT:";
     m_padding = "  ";
 
-    // skip size of lookup table
-    m_bytecode.seekg(WORD_SIZE, m_bytecode.cur);
-    while (true) {
-      auto opcode = read();
-      if (m_bytecode.eof() || m_bytecode.fail()) {
-        break;
-      }
-      printOpcode(static_cast<Opcode::Type>(opcode));
+    // skip the sizes of the lookup table and of the call caches
+    m_bytecode.seekg(start + 2 * WORD_SIZE);
+    auto end = start + m_sections[Section::Text].second;
+    while (m_bytecode.tellg() < end) {
+      printOpcode(readOpcode());
+    }
+  }
+
+  std::string Disassembler::functionName(unsigned fnID) {
+    if (fnID < m_functions.size()) {
+      return m_functions[fnID];
     }
+    return "#" + std::to_string(fnID);
   }
 
   void Disassembler::printOpcode(Opcode::Type opcode) {
+    // the components of a superinstruction are printed as usual below it
+    auto first = Opcode::firstComponent(opcode);
+    if (first != opcode) {
+      writeInstruction() << Opcode::typeName(opcode) << ":";
+      opcode = first;
+    }
+
     switch (opcode) {
       case Opcode::push: {
-        auto value = read();
-        write(1)
+        auto value = readOperand();
+        writeInstruction()
           << "push 0x"
           << std::setbase(16)
           << value
@@ -163,100 +215,175 @@ namespace Verve {
         break;
       }
       case Opcode::call: {
-        auto argc = read();
-        write(1) << "call (" << argc << ")";
+        auto argc = readOperand();
+        readOperand(); // inline cache slot
+        writeInstruction() << "call (" << argc << ")";
+        break;
+      }
+      case Opcode::call_direct: {
+        auto fnID = readOperand();
+        auto argc = readOperand();
+        writeInstruction() << "call_direct " << functionName(fnID) << " (" << argc << ")";
+        break;
+      }
+      case Opcode::jit_count: {
+        auto fnID = readOperand();
+        writeInstruction() << "jit_count " << functionName(fnID);
+        break;
+      }
+      case Opcode::tail_call: {
+        auto argc = readOperand();
+        writeInstruction() << "tail_call (" << argc << ")";
+        break;
+      }
+      case Opcode::tail_call_direct: {
+        auto fnID = readOperand();
+        auto argc = readOperand();
+        writeInstruction() << "tail_call_direct " << functionName(fnID) << " (" << argc << ")";
         break;
       }
       case Opcode::load_string: {
-        auto stringID = read();
-        write(1) << "load_string $" << m_strings[stringID];
+        auto stringID = readOperand();
+        writeInstruction() << "load_string $" << m_strings[stringID];
         break;
       }
       case Opcode::lookup: {
-        auto symbol = read();
-        auto cacheSlot = read();
-        write(2) << "lookup $" << symbol << "(" << m_strings[symbol] << ") [cacheSlot=" << cacheSlot << "]";
+        auto symbol = readOperand();
+        auto cacheSlot = readOperand();
+        writeInstruction() << "lookup $" << symbol << "(" << m_strings[symbol] << ") [cacheSlot=" << cacheSlot << "]";
         break;
       }
       case Opcode::create_closure: {
-        auto fnID = read();
-        auto capturesScope = read() ? "true" : "false";
-        write(2) << "create_closure " << m_functions[fnID] << " [capturesScope=" << capturesScope << "]";
+        auto fnID = readOperand();
+        auto captures = readOperand();
+        writeInstruction() << "create_closure " << functionName(fnID) << " [captures=" << captures << "]";
         break;
       }
       case Opcode::jmp: {
-        auto target = read();
-        write(1) << "jmp [" << calculateJmpTarget(target) << "]";
+        auto target = readOperand();
+        writeInstruction() << "jmp [" << calculateJmpTarget(target) << "]";
         break;
       }
       case Opcode::jz: {
-        auto target = read();
-        write(1) << "jz [" << calculateJmpTarget(target) << "]";
+        auto target = readOperand();
+        writeInstruction() << "jz [" << calculateJmpTarget(target) << "]";
+        break;
+      }
+      case Opcode::switch_tag: {
+        auto size = readOperand();
+        std::string targets;
+        for (unsigned i = 0; i < size; i++) {
+          targets += (i ? " " : "") + std::to_string(calculateJmpTarget(readOperand()));
+        }
+        writeInstruction() << "switch_tag [" << targets << "]";
+        break;
+      }
+      case Opcode::add_i32_rr:
+      case Opcode::sub_i32_rr:
+      case Opcode::mul_i32_rr:
+      case Opcode::div_i32_rr:
+      case Opcode::mod_i32_rr:
+      case Opcode::lt_i32_rr:
+      case Opcode::gt_i32_rr:
+      case Opcode::lte_i32_rr:
+      case Opcode::gte_i32_rr:
+      case Opcode::eq_i32_rr:
+      case Opcode::ne_i32_rr:
+      case Opcode::and_i32_rr:
+      case Opcode::or_i32_rr:
+      {
+        auto lhs = readOperand();
+        auto rhs = readOperand();
+        writeInstruction() << Opcode::typeName(opcode) << " r" << lhs << ", r" << rhs;
+        break;
+      }
+      case Opcode::add_i32_rk:
+      case Opcode::sub_i32_rk:
+      case Opcode::mul_i32_rk:
+      case Opcode::div_i32_rk:
+      case Opcode::mod_i32_rk:
+      case Opcode::lt_i32_rk:
+      case Opcode::gt_i32_rk:
+      case Opcode::lte_i32_rk:
+      case Opcode::gte_i32_rk:
+      case Opcode::eq_i32_rk:
+      case Opcode::ne_i32_rk:
+      case Opcode::and_i32_rk:
+      case Opcode::or_i32_rk:
+      {
+        auto lhs = readOperand();
+        auto rhs = readOperand();
+        writeInstruction() << Opcode::typeName(opcode) << " r" << lhs << ", " << (int32_t)rhs;
         break;
       }
       case Opcode::push_arg: {
-        auto argID = read();
-        write(1) << "push_arg $" << argID;
+        auto argID = readOperand();
+        writeInstruction() << "push_arg $" << argID;
         break;
       }
-      case Opcode::put_to_scope: {
-        auto argID = read();
-        write(1) << "put_to_scope $" << m_strings[argID];
+      case Opcode::closure_load: {
+        auto index = readOperand();
+        writeInstruction() << "closure_load #" << index;
         break;
       }
       case Opcode::bind: {
-        auto stringID = read();
-        write(1) << "bind $" << m_strings[stringID];
+        auto stringID = readOperand();
+        writeInstruction() << "bind $" << m_strings[stringID];
         break;
       }
       case Opcode::alloc_obj: {
-        auto size = read();
-        auto tag = read();
-        write(2) << "alloc_obj (size=" << size << ", tag=" << tag << ")";
+        auto size = readOperand();
+        auto tag = readOperand();
+        writeInstruction() << "alloc_obj (size=" << size << ", tag=" << tag << ")";
         break;
       }
       case Opcode::alloc_list: {
-        auto size = read();
-        write(1) << "alloc_list (size=" << size << ")";
+        auto size = readOperand();
+        writeInstruction() << "alloc_list (size=" << size << ")";
         break;
       }
       case Opcode::obj_store_at: {
-        auto index = read();
-        write(1) << "obj_store_at #" << index;
+        auto index = readOperand();
+        writeInstruction() << "obj_store_at #" << index;
         break;
       }
       case Opcode::obj_tag_test: {
-        auto tag = read();
-        write(1) << "obj_tag_test #" << tag;
+        auto tag = readOperand();
+        writeInstruction() << "obj_tag_test #" << tag;
         break;
       }
       case Opcode::obj_load: {
-        auto offset = read();
-        write(1) << "obj_load #" << offset;
+        auto offset = readOperand();
+        writeInstruction() << "obj_load #" << offset;
         break;
       }
       case Opcode::stack_alloc: {
-        auto size = read();
-        write(1) << "stack_alloc #" << size;
+        auto size = readOperand();
+        writeInstruction() << "stack_alloc #" << size;
         break;
       }
       case Opcode::stack_store: {
-        auto slot = read();
-        write(1) << "stack_store #" << slot;
+        auto slot = readOperand();
+        writeInstruction() << "stack_store #" << slot;
         break;
       }
       case Opcode::stack_load: {
-        auto slot = read();
-        write(1) << "stack_load #" << slot;
+        auto slot = readOperand();
+        writeInstruction() << "stack_load #" << slot;
         break;
       }
       case Opcode::stack_free: {
-        auto size = read();
-        write(1) << "stack_free #" << size;
+        auto size = readOperand();
+        writeInstruction() << "stack_free #" << size;
+        break;
+      }
+      case Opcode::stack_unwind: {
+        auto size = readOperand();
+        writeInstruction() << "stack_unwind #" << size;
         break;
       }
       default:
-        write() << Opcode::typeName(static_cast<Opcode::Type>(opcode));
+        writeInstruction() << Opcode::typeName(static_cast<Opcode::Type>(opcode));
     }
   }
 }
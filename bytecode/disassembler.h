@@ -1,3 +1,5 @@
+#include <iostream>
+#include <map>
 #include <sstream>
 #include <vector>
 
@@ -25,9 +27,14 @@ private:
   };
 
   HelperStream write(int offset = 0);
+  HelperStream writeAt(int position);
   int64_t read();
+  Opcode::Type readOpcode();
+  int64_t readOperand();
+  HelperStream writeInstruction();
   std::string readStr();
   int calculateJmpTarget(int target);
+  std::string functionName(unsigned fnID);
   void printOpcode(Opcode::Type opcode);
   void dumpStrings();
   void dumpFunctions();
@@ -36,6 +43,10 @@ private:
   std::stringstream &m_bytecode;
   std::vector<std::string> m_strings;
   std::vector<std::string> m_functions;
+  // section type => offset and length, in bytes
+  std::map<int64_t, std::pair<int64_t, int64_t>> m_sections;
+  Section::Encoding m_encoding = Section::Wide;
+  std::streampos m_opcodeEnd;
   size_t m_width;
   std::string m_padding = "  ";
 };
@@ -1,97 +1,519 @@
 #include "generator.h"
+#include "compact.h"
 #include "opcodes.h"
 #include "sections.h"
 
 #include "parser/parser.h"
+#include "runtime/value.h"
+
+#include <algorithm>
+#include <map>
 
 namespace Verve {
 
   std::stringstream &Generator::generate() {
+    collectBindings(m_ast);
+
+    std::vector<AST::Function *> enclosing;
+    collectCaptures(m_ast, enclosing);
+    hoistSlots(m_ast, nullptr);
+    collectScalarReplacements(m_ast, nullptr);
     m_ast->generateBytecode(this);
+    emitOpcode(Opcode::exit);
+    optimizeCode(0);
 
     auto text = m_output.str();
     m_output = std::stringstream();
+    m_straightLine.clear();
 
-    if (m_functions.size()) {
-      for (unsigned i = 0; i < m_functions.size(); i++) {
-        write(Section::FunctionHeader);
-        generateFunctionSource(m_functions[i]);
+    for (unsigned i = 0; i < m_functions.size(); i++) {
+      generateFunctionSource(m_functions[i], i);
+    }
+    auto code = m_output.str();
+
+    // functions are encoded one at a time, since their jumps are relative
+    // to their own code
+    if (m_useCompactEncoding) {
+      std::string compact;
+      for (auto &entry : m_functionEntries) {
+        auto function = CompactEncoding::encode(code.substr(entry.offset, entry.length));
+        entry.offset = compact.size();
+        entry.length = function.size();
+        compact += function;
       }
+      compact.resize((compact.size() + WORD_SIZE - 1) & ~(WORD_SIZE - 1));
+      code = compact;
+      text = CompactEncoding::encode(text);
     }
 
-    auto functions = m_output.str();
+    // string offsets are relative to the section
     m_output = std::stringstream();
-
-    if (m_strings.size()) {
-      write(Section::Header);
-      write(Section::Strings);
-
-      for (auto string : m_strings) {
-        write(string);
-      }
+    write(m_strings.size());
+    int64_t offset = (1 + m_strings.size()) * WORD_SIZE;
+    for (auto &string : m_strings) {
+      write(offset);
+      offset += string.size() + 1;
+    }
+    for (auto &string : m_strings) {
+      write(string);
     }
-
     unsigned index = m_output.tellp();
     while (index++ % WORD_SIZE) {
       m_output.put(1);
     }
+    auto strings = m_output.str();
 
-    if (functions.length()) {
-      write(Section::Header);
-      write(Section::Functions);
-      m_output << functions;
+    int64_t tableLength = (1 + m_functionEntries.size() * Section::FunctionEntrySize) * WORD_SIZE;
+    for (auto &entry : m_functionEntries) {
+      tableLength += entry.args.size() * WORD_SIZE;
     }
 
+    std::vector<std::pair<Section::Type, int64_t>> sections = {
+      { Section::Strings, (int64_t)strings.size() },
+      { Section::Functions, tableLength },
+      { Section::Code, (int64_t)code.size() },
+      { Section::Text, (int64_t)(2 * WORD_SIZE + text.size()) },
+    };
+
+    m_output = std::stringstream();
     write(Section::Header);
-    write(Section::Text);
+    write(Section::Version);
+    write(m_useCompactEncoding ? Section::Compact : Section::Wide);
+    write(sections.size());
+    offset = (4 + 3 * sections.size()) * WORD_SIZE;
+    int64_t codeOffset = 0;
+    for (auto &section : sections) {
+      if (section.first == Section::Code) {
+        codeOffset = offset;
+      }
+      write(section.first);
+      write(offset);
+      write(section.second);
+      offset += section.second;
+    }
+
+    m_output << strings;
+
+    write(m_functionEntries.size());
+    unsigned firstArg = 0;
+    for (auto &entry : m_functionEntries) {
+      write(entry.name);
+      write(entry.args.size());
+      write(firstArg);
+      write(codeOffset + entry.offset);
+      write(entry.length);
+      firstArg += entry.args.size();
+    }
+    for (auto &entry : m_functionEntries) {
+      for (auto arg : entry.args) {
+        write(arg);
+      }
+    }
+
+    m_output << code;
+
     write(lookupID);
+    write(callCacheID);
     m_output << text;
-
-    emitOpcode(Opcode::exit);
     m_output.seekg(0);
 
     return m_output;
   }
 
-  void Generator::generateFunctionSource(AST::Function *fn) {
+  void Generator::generateFunctionSource(AST::Function *fn, unsigned fnID) {
     std::string fnName = fn->name;
     if (fnName == "_") {
       static unsigned id = 0;
       fnName = "_" + std::to_string(id++);
     }
-    write(uniqueString(fnName));
-    write(fn->parameters.size());
 
-    std::vector<unsigned> captured;
+    FunctionEntry entry;
+    entry.name = uniqueString(fnName);
     for (unsigned i = 0; i < fn->parameters.size(); i++) {
-      write(uniqueString(fn->parameters[i]->name));
+      entry.args.push_back(uniqueString(fn->parameters[i]->name));
+    }
 
-      if (fn->parameters[i]->isCaptured) {
-        captured.push_back(i);
+    m_slots.clear();
+    stackSlot = 0;
+    frameSlots = fn->body->stackSlots;
+    currentFunction = fn;
+    int64_t start = m_output.tellp();
+    if (m_countCalls) {
+      emitOpcode(Opcode::jit_count);
+      write(fnID);
+    }
+    markTailCalls(fn->body);
+    fn->body->generateBytecode(this);
+    currentFunction = nullptr;
+
+    emitOpcode(Opcode::ret);
+    optimizeCode(start);
+
+    entry.offset = start;
+    entry.length = (int64_t)m_output.tellp() - start;
+    m_functionEntries.push_back(std::move(entry));
+  }
+
+  void Generator::collectBindings(AST::NodePtr node) {
+    switch (node->type) {
+      case AST::Type::Function: {
+        auto fn = AST::asFunction(node);
+        if (fn->name != "_") {
+          m_functionBindings[namespaced(fn->ns, fn->name)]++;
+        }
+        break;
+      }
+      case AST::Type::FunctionParameter:
+        m_localBindings.insert(std::static_pointer_cast<AST::FunctionParameter>(node)->name);
+        break;
+      case AST::Type::Assignment: {
+        auto assignment = AST::asAssignment(node);
+        if (assignment->left->type == AST::Type::Identifier) {
+          m_localBindings.insert(AST::asIdentifier(assignment->left)->name);
+        }
+        break;
       }
+      case AST::Type::Pattern:
+        for (auto value : AST::asPattern(node)->values) {
+          m_localBindings.insert(value->name);
+        }
+        break;
+      default:
+        break;
     }
 
-    if (fn->needsScope) {
-      emitOpcode(Opcode::create_lex_scope);
+    node->visit([this](AST::NodePtr child) {
+      collectBindings(child);
+    });
+  }
+
+  // Builds the list of values each function captures: the declarations of
+  // enclosing functions referenced from it or from functions nested in it.
+  void Generator::collectCaptures(AST::NodePtr node, std::vector<AST::Function *> &functions) {
+    switch (node->type) {
+      case AST::Type::Function: {
+        auto fn = AST::asFunction(node);
+        if (fn->declaration) {
+          m_declarationLevels[fn->declaration.get()] = functions.size();
+        }
+
+        functions.push_back(fn.get());
+        for (auto param : fn->parameters) {
+          m_declarationLevels[param.get()] = functions.size();
+        }
+        collectCaptures(fn->body, functions);
+        functions.pop_back();
+        return;
+      }
+      case AST::Type::Assignment: {
+        auto assignment = AST::asAssignment(node);
+        if (assignment->left->type == AST::Type::Identifier) {
+          m_declarationLevels[AST::asIdentifier(assignment->left).get()] = functions.size();
+        }
+        break;
+      }
+      case AST::Type::Pattern:
+        for (auto value : AST::asPattern(node)->values) {
+          m_declarationLevels[value.get()] = functions.size();
+        }
+        break;
+      case AST::Type::Identifier: {
+        auto binding = AST::asIdentifier(node)->binding;
+        if (!binding) {
+          break;
+        }
+
+        for (auto level = functions.size(); level > m_declarationLevels[binding]; level--) {
+          auto fn = functions[level - 1];
+          // functions refer to themselves through their frame
+          if (fn->declaration.get() == binding) {
+            break;
+          }
+          if (std::find(fn->captures.begin(), fn->captures.end(), binding) == fn->captures.end()) {
+            fn->captures.push_back(binding);
+          }
+        }
+        break;
+      }
+      default:
+        break;
     }
 
-    for (auto i : captured) {
-      emitOpcode(Opcode::push_arg);
-      write(i);
-      emitOpcode(Opcode::put_to_scope);
-      write(uniqueString(fn->parameters[i]->name));
+    node->visit([&](AST::NodePtr child) {
+      collectCaptures(child, functions);
+    });
+  }
+
+  // Every function, and the program, allocates the slots of all of its
+  // blocks in a single frame on entry: the blocks of imported files give
+  // theirs to the frame that encloses them. Slots are numbered per frame, and
+  // registers address them from the frame pointer.
+  void Generator::hoistSlots(AST::NodePtr node, AST::Block *frame) {
+    switch (node->type) {
+      case AST::Type::Program:
+        frame = AST::asProgram(node)->body.get();
+        break;
+      case AST::Type::Function:
+        frame = AST::asFunction(node)->body.get();
+        break;
+      case AST::Type::Block: {
+        auto block = AST::asBlock(node).get();
+        if (frame && block != frame) {
+          frame->stackSlots += block->stackSlots;
+          block->stackSlots = 0;
+        }
+        break;
+      }
+      default:
+        break;
     }
 
-    m_slots.clear();
-    stackSlot = 0;
-    capturesScope = fn->capturesScope;
-    fn->body->generateBytecode(this);
+    node->visit([&](AST::NodePtr child) {
+      hoistSlots(child, frame);
+    });
+  }
 
-    if (fn->needsScope) {
-      emitOpcode(Opcode::release_lex_scope);
+  // Escape analysis: finds the objects built by a `let` that are only ever
+  // destructured by `match`es and `let` patterns in its scope. They are never
+  // allocated, their fields are kept in stack slots of the enclosing frame,
+  // which has to reserve the extra slots before it is generated.
+  void Generator::collectScalarReplacements(AST::NodePtr node, AST::Block *frame) {
+    switch (node->type) {
+      case AST::Type::Program:
+        frame = AST::asProgram(node)->body.get();
+        break;
+      case AST::Type::Function:
+        frame = AST::asFunction(node)->body.get();
+        break;
+      case AST::Type::Let: {
+        auto let = AST::asLet(node);
+        for (unsigned i = 0; i < let->assignments.size(); i++) {
+          auto assignment = let->assignments[i];
+          if (assignment->left->type != AST::Type::Identifier || !isCompleteConstructor(assignment->value)) {
+            continue;
+          }
+
+          auto name = AST::asIdentifier(assignment->left)->name;
+          auto object = AST::asConstructor(assignment->value).get();
+          bool escaped = escapes(name, object, let->block);
+          for (unsigned j = i + 1; j < let->assignments.size() && !escaped; j++) {
+            escaped = escapes(name, object, let->assignments[j]);
+          }
+
+          if (!escaped) {
+            m_scalarReplaced.insert(assignment.get());
+            // the parser reserved one slot for the object itself
+            if (object->size > 1) {
+              frame->stackSlots += object->size - 1;
+            }
+          }
+        }
+        break;
+      }
+      default:
+        break;
     }
 
-    emitOpcode(Opcode::ret);
+    node->visit([&](AST::NodePtr child) {
+      collectScalarReplacements(child, frame);
+    });
+  }
+
+  // Whether `node` uses the object bound to `name` as anything else than the
+  // value of a `match` or `let` pattern that can be resolved statically.
+  // Shadowing `name` or referencing it from a nested function count too.
+  bool Generator::escapes(const std::string &name, AST::Constructor *object, AST::NodePtr node) {
+    switch (node->type) {
+      case AST::Type::Identifier:
+      case AST::Type::FunctionParameter:
+        return std::static_pointer_cast<AST::Identifier>(node)->name == name;
+      case AST::Type::Function:
+        // captured objects have to be allocated
+        return mentions(name, node);
+      case AST::Type::Match: {
+        auto match = AST::asMatch(node);
+        if (!isIdentifier(match->value, name)) {
+          break;
+        }
+
+        bool matches = false;
+        for (auto kase : match->cases) {
+          matches = matches || kase->pattern->tag == object->tag;
+        }
+        if (!matches) {
+          return true;
+        }
+        for (auto kase : match->cases) {
+          if (escapes(name, object, kase)) {
+            return true;
+          }
+        }
+        return false;
+      }
+      case AST::Type::Assignment: {
+        auto assignment = AST::asAssignment(node);
+        if (assignment->left->type != AST::Type::Pattern || !isIdentifier(assignment->value, name)) {
+          break;
+        }
+
+        auto pattern = AST::asPattern(assignment->left);
+        return pattern->tag != object->tag || escapes(name, object, pattern);
+      }
+      default:
+        break;
+    }
+
+    bool escaped = false;
+    node->visit([&](AST::NodePtr child) {
+      escaped = escaped || escapes(name, object, child);
+    });
+    return escaped;
+  }
+
+  bool Generator::mentions(const std::string &name, AST::NodePtr node) {
+    switch (node->type) {
+      case AST::Type::Identifier:
+      case AST::Type::FunctionParameter:
+        return std::static_pointer_cast<AST::Identifier>(node)->name == name;
+      case AST::Type::Function: {
+        auto fn = AST::asFunction(node);
+        if (fn->declaration && fn->declaration->name == name) {
+          return true;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+
+    bool mentioned = false;
+    node->visit([&](AST::NodePtr child) {
+      mentioned = mentioned || mentions(name, child);
+    });
+    return mentioned;
+  }
+
+  bool Generator::isIdentifier(AST::NodePtr node, const std::string &name) {
+    return node->type == AST::Type::Identifier && AST::asIdentifier(node)->name == name;
+  }
+
+  bool Generator::isCompleteConstructor(AST::NodePtr node) {
+    return node->type == AST::Type::Constructor &&
+      AST::asConstructor(node)->arguments.size() == AST::asConstructor(node)->size;
+  }
+
+  // The tag of `value` if it doesn't need to be allocated: a scalar replaced
+  // `let`, or a constructor that is destructured straight away.
+  bool Generator::scalarTag(AST::NodePtr value, unsigned &tag) {
+    if (value->type == AST::Type::Identifier) {
+      auto it = m_scalars.find(AST::asIdentifier(value)->name);
+      if (it == m_scalars.end()) {
+        return false;
+      }
+      tag = it->second.tag;
+      return true;
+    }
+    if (!isCompleteConstructor(value)) {
+      return false;
+    }
+    tag = AST::asConstructor(value)->tag;
+    return true;
+  }
+
+  // The slots holding the fields of `value`, see `scalarTag`. The arguments
+  // of a constructor are stored in new slots: the parser reserved one for
+  // each of the `arity` values of the pattern that destructures it.
+  bool Generator::scalarObject(AST::NodePtr value, unsigned arity, ScalarObject &object) {
+    if (value->type == AST::Type::Identifier) {
+      auto it = m_scalars.find(AST::asIdentifier(value)->name);
+      if (it == m_scalars.end()) {
+        return false;
+      }
+      object = it->second;
+      return true;
+    }
+
+    if (!isCompleteConstructor(value) || AST::asConstructor(value)->size != arity) {
+      return false;
+    }
+
+    auto constructor = AST::asConstructor(value);
+    object.tag = constructor->tag;
+    object.slots.clear();
+    for (auto argument : constructor->arguments) {
+      auto slot = stackSlot++;
+      argument->generateBytecode(this);
+      emitOpcode(Opcode::stack_store);
+      write(slot);
+      object.slots.push_back(slot);
+    }
+    return true;
+  }
+
+  // Pushes the value of a declaration referenced from the function being
+  // generated, which can be one of its captures.
+  void Generator::loadCaptured(AST::Identifier *declaration) {
+    if (currentFunction) {
+      if (declaration == currentFunction->declaration.get()) {
+        emitOpcode(Opcode::push_callee);
+        return;
+      }
+
+      auto &captures = currentFunction->captures;
+      auto it = std::find(captures.begin(), captures.end(), declaration);
+      if (it != captures.end()) {
+        emitOpcode(Opcode::closure_load);
+        write(it - captures.begin());
+        return;
+      }
+    }
+
+    declaration->generateBytecode(this);
+  }
+
+  // Marks the calls whose result is returned straight away by the function
+  // being generated, so they can reuse its frame.
+  void Generator::markTailCalls(AST::NodePtr node) {
+    switch (node->type) {
+      case AST::Type::Block: {
+        auto block = AST::asBlock(node);
+        if (block->nodes.size()) {
+          markTailCalls(block->nodes.back());
+        }
+        break;
+      }
+      case AST::Type::If: {
+        auto ifNode = AST::asIf(node);
+        markTailCalls(ifNode->ifBody);
+        if (ifNode->elseBody) {
+          markTailCalls(ifNode->elseBody);
+        }
+        break;
+      }
+      case AST::Type::Match:
+        for (auto kase : AST::asMatch(node)->cases) {
+          markTailCalls(kase->body);
+        }
+        break;
+      case AST::Type::Let:
+        markTailCalls(AST::asLet(node)->block);
+        break;
+      case AST::Type::Call:
+        AST::asCall(node)->isTailCall = true;
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Everything the `stack_free`s on the way out would undo has to be undone
+  // before the frame is reused: the arguments and the callee are already on
+  // the stack, so the stack slots can go.
+  void Generator::emitTailCallPrologue() {
+    for (auto it = m_stackAllocs.rbegin(); it != m_stackAllocs.rend(); it++) {
+      emitOpcode(Opcode::stack_unwind);
+      write(*it);
+    }
   }
 
   void Generator::write(int64_t data) {
@@ -104,11 +526,146 @@ namespace Verve {
   }
 
   void Generator::emitOpcode(Opcode::Type opcode) {
-    if (m_shouldLink) {
-      write(Opcode::address(opcode));
-    } else {
+    if (m_usePeephole) {
+      // fused by `optimizeCode`
       write(opcode);
+      return;
+    }
+
+    if (m_useSuperinstructions) {
+      fuse(opcode);
     }
+
+    write(opcode);
+  }
+
+  // Runs the peephole pass over the code emitted since `start`, a whole
+  // function or the text, and emits what's left again
+  void Generator::optimizeCode(int64_t start) {
+    if (!m_usePeephole) {
+      return;
+    }
+
+    auto output = m_output.str();
+    Peephole peephole(output.substr(start), frameSlots);
+    peephole.optimize();
+
+    m_output = std::stringstream();
+    m_output << output.substr(0, start);
+    m_straightLine.clear();
+
+    m_usePeephole = false;
+    emitInstructions(peephole.instructions());
+    m_usePeephole = true;
+  }
+
+  // Jump offsets are computed from the size of the instructions in between,
+  // which superinstructions don't change
+  void Generator::emitInstructions(const std::vector<Instruction> &instructions) {
+    std::vector<int64_t> offsets;
+    int64_t offset = 0;
+    for (auto &instruction : instructions) {
+      offsets.push_back(offset);
+      offset += (1 + instruction.operands.size()) * WORD_SIZE;
+      if (instruction.opcode == Opcode::switch_tag) {
+        offset += instruction.targets.size() * WORD_SIZE;
+      }
+    }
+    offsets.push_back(offset);
+
+    for (size_t i = 0; i < instructions.size(); i++) {
+      auto &instruction = instructions[i];
+      emitOpcode(instruction.opcode);
+      if (instruction.opcode == Opcode::switch_tag) {
+        write(instruction.operands[0]);
+        for (auto target : instruction.targets) {
+          write(offsets[target] - offsets[i]);
+        }
+      } else if (Peephole::isJump(instruction.opcode)) {
+        write(offsets[instruction.targets[0]] - offsets[i]);
+      } else {
+        for (auto operand : instruction.operands) {
+          write(operand);
+        }
+      }
+    }
+  }
+
+  // every call site gets its own inline cache, which starts empty
+  void Generator::emitCall(unsigned argc) {
+    emitOpcode(Opcode::call);
+    write(argc);
+    write(callCacheID++);
+  }
+
+#define SUPERINSTRUCTION_2(__name, __a, _, __b) \
+  { { Opcode::__a, Opcode::__b }, Opcode::__name },
+#define SUPERINSTRUCTION_3(__name, __a, _, __b, __, __c) \
+  { { Opcode::__a, Opcode::__b, Opcode::__c }, Opcode::__name },
+
+  static const std::map<std::vector<Opcode::Type>, Opcode::Type> s_superinstructions = {
+    SUPERINSTRUCTIONS_2(SUPERINSTRUCTION_2)
+    SUPERINSTRUCTIONS_3(SUPERINSTRUCTION_3)
+  };
+
+  // Peephole pass over the instructions as they are emitted: when `opcode`
+  // ends a sequence that has a superinstruction, the opcode of the first
+  // instruction of the sequence is replaced by it.
+  void Generator::fuse(Opcode::Type opcode) {
+    int64_t position = m_output.tellp();
+    auto &previous = m_straightLine;
+    if (previous.size() && previous.back().first + (Opcode::size(previous.back().second) + 1) * WORD_SIZE != position) {
+      previous.clear();
+    }
+
+    auto n = previous.size();
+    if (n >= 1) {
+      auto pair = s_superinstructions.find({ previous[n - 1].second, opcode });
+      if (pair != s_superinstructions.end()) {
+        rewriteOpcode(previous[n - 1].first, pair->second);
+      }
+    }
+    if (n >= 2) {
+      auto triple = s_superinstructions.find({ previous[n - 2].second, previous[n - 1].second, opcode });
+      if (triple != s_superinstructions.end()) {
+        rewriteOpcode(previous[n - 2].first, triple->second);
+      }
+    }
+
+    if (!Opcode::isStraightLine(opcode)) {
+      previous.clear();
+      return;
+    }
+    if (n == 2) {
+      previous.erase(previous.begin());
+    }
+    previous.push_back({ position, opcode });
+  }
+
+  void Generator::rewriteOpcode(int64_t position, Opcode::Type opcode) {
+    auto end = m_output.tellp();
+    m_output.seekp(position);
+    write(opcode);
+    m_output.seekp(end);
+  }
+
+  // Registers are word offsets from the frame pointer: arguments live above it
+  // and the slots of the current function right below it.
+  bool Generator::registerFor(AST::NodePtr node, int64_t &reg) {
+    if (node->type == AST::Type::FunctionParameter) {
+      reg = 4 + AST::asFunctionParameter(node)->index;
+      return true;
+    }
+
+    if (node->type != AST::Type::Identifier || AST::asIdentifier(node)->binding) {
+      return false;
+    }
+    auto slot = m_slots.find(AST::asIdentifier(node)->name);
+    if (slot == m_slots.end()) {
+      return false;
+    }
+    reg = (int64_t)slot->second - 1 - frameSlots;
+    return true;
   }
 
   void Generator::emitJmp(Opcode::Type jmpType, AST::BlockPtr &body)  {
@@ -146,10 +703,12 @@ namespace AST {
 void Number::generateBytecode(Generator *gen) {
   if (isFloat) {
     gen->emitOpcode(Opcode::push);
-    gen->write(*(int64_t *)&value);
+    gen->write(Value(value).encode());
   } else {
+    // ints only use the low 32 bits, negative constants are left by the
+    // optimizer
     gen->emitOpcode(Opcode::push);
-    gen->write(value);
+    gen->write((uint32_t)(int64_t)value);
   }
 }
 
@@ -158,31 +717,54 @@ void Call::generateBytecode(Generator *gen) {
     arguments[--i]->generateBytecode(gen);
   }
 
+  if (callee->type == AST::Type::Identifier) {
+    auto ident = AST::asIdentifier(callee);
+    auto it = gen->m_directCalls.find(namespaced(ident->ns, ident->name));
+    if (it != gen->m_directCalls.end()) {
+      if (isTailCall) {
+        gen->emitTailCallPrologue();
+        gen->emitOpcode(Opcode::tail_call_direct);
+      } else {
+        gen->emitOpcode(Opcode::call_direct);
+      }
+      gen->write(it->second);
+      gen->write(arguments.size());
+      return;
+    }
+  }
+
   callee->generateBytecode(gen);
 
-  gen->emitOpcode(Opcode::call);
-  gen->write(arguments.size());
+  if (isTailCall) {
+    gen->emitTailCallPrologue();
+    gen->emitOpcode(Opcode::tail_call);
+    gen->write(arguments.size());
+  } else {
+    gen->emitCall(arguments.size());
+  }
 }
 
 
 void Identifier::generateBytecode(Generator *gen) {
-  if (!isCaptured) {
-    auto it = gen->m_slots.find(name);
-    if (it != gen->m_slots.end()) {
-      gen->emitOpcode(Opcode::stack_load);
-      gen->write(it->second);
-      return;
-    }
+  if (binding) {
+    gen->loadCaptured(binding);
+    return;
+  }
+
+  auto it = gen->m_slots.find(name);
+  if (it != gen->m_slots.end()) {
+    gen->emitOpcode(Opcode::stack_load);
+    gen->write(it->second);
+    return;
   }
 
+  // Only globals and builtins are left to look up, captured values are read
+  // from the closure, so every site can be cached: `bind` empties the cache
+  // when it shadows a name
   gen->emitOpcode(Opcode::lookup);
   auto name = namespaced(ns, this->name);
   gen->write(gen->uniqueString(name));
-  if (gen->capturesScope) {
-    gen->write(0);
-  } else {
-    gen->write(gen->lookupID++);
-  }
+  gen->write(gen->lookupID++);
 }
 
 void String::generateBytecode(Generator *gen) {
@@ -219,6 +801,7 @@ void If::generateBytecode(Generator *gen) {
 }
 
 void Program::generateBytecode(Generator *gen) {
+  gen->frameSlots = body->stackSlots;
   body->generateBytecode(gen);
 }
 
@@ -226,6 +809,7 @@ void Block::generateBytecode(Generator *gen) {
   if (stackSlots > 0) {
     gen->emitOpcode(Opcode::stack_alloc);
     gen->write(stackSlots * WORD_SIZE);
+    gen->m_stackAllocs.push_back(stackSlots * WORD_SIZE);
   }
 
   for (auto node : nodes) {
@@ -233,98 +817,262 @@ void Block::generateBytecode(Generator *gen) {
   }
 
   if (stackSlots > 0) {
+    gen->m_stackAllocs.pop_back();
     gen->emitOpcode(Opcode::stack_free);
     gen->write(stackSlots * WORD_SIZE);
   }
 }
 
+static Opcode::Type intBinaryOpcode(unsigned op) {
+  switch (op) {
+    case '+': return Opcode::add_i32;
+    case '-': return Opcode::sub_i32;
+    case '*': return Opcode::mul_i32;
+    case '/': return Opcode::div_i32;
+    case '%': return Opcode::mod_i32;
+    case '<': return Opcode::lt_i32;
+    case '>': return Opcode::gt_i32;
+    case TUPLE_TOKEN('<', '='): return Opcode::lte_i32;
+    case TUPLE_TOKEN('>', '='): return Opcode::gte_i32;
+    case TUPLE_TOKEN('=', '='): return Opcode::eq_i32;
+    case TUPLE_TOKEN('!', '='): return Opcode::ne_i32;
+    case TUPLE_TOKEN('&', '&'): return Opcode::and_i32;
+    case TUPLE_TOKEN('|', '|'): return Opcode::or_i32;
+    default:
+      throw std::runtime_error("Unknown binary operator");
+  }
+}
+
+static Opcode::Type floatBinaryOpcode(unsigned op) {
+  switch (op) {
+    case '+': return Opcode::add_f64;
+    case '-': return Opcode::sub_f64;
+    case '*': return Opcode::mul_f64;
+    case '/': return Opcode::div_f64;
+    case '<': return Opcode::lt_f64;
+    case '>': return Opcode::gt_f64;
+    case TUPLE_TOKEN('<', '='): return Opcode::lte_f64;
+    case TUPLE_TOKEN('>', '='): return Opcode::gte_f64;
+    case TUPLE_TOKEN('=', '='): return Opcode::eq_f64;
+    case TUPLE_TOKEN('!', '='): return Opcode::ne_f64;
+    default:
+      throw std::runtime_error("Unknown binary operator");
+  }
+}
+
+// The register form of an int operation, or `ret` if there's none: `_rk`
+// operations take a constant rhs, `_rr` ones a register.
+static Opcode::Type intRegisterOpcode(unsigned op, bool constant) {
+#define REGISTER_OPCODE(__name) return constant ? Opcode::__name##_i32_rk : Opcode::__name##_i32_rr
+  switch (op) {
+    case '+': REGISTER_OPCODE(add);
+    case '-': REGISTER_OPCODE(sub);
+    case '*': REGISTER_OPCODE(mul);
+    case '/': REGISTER_OPCODE(div);
+    case '%': REGISTER_OPCODE(mod);
+    case '<': REGISTER_OPCODE(lt);
+    case '>': REGISTER_OPCODE(gt);
+    case TUPLE_TOKEN('<', '='): REGISTER_OPCODE(lte);
+    case TUPLE_TOKEN('>', '='): REGISTER_OPCODE(gte);
+    case TUPLE_TOKEN('=', '='): REGISTER_OPCODE(eq);
+    case TUPLE_TOKEN('!', '='): REGISTER_OPCODE(ne);
+    case TUPLE_TOKEN('&', '&'): REGISTER_OPCODE(and);
+    case TUPLE_TOKEN('|', '|'): REGISTER_OPCODE(or);
+    default: return Opcode::ret;
+  }
+#undef REGISTER_OPCODE
+}
+
+// the operator that gives the same result with its operands swapped, or 0
+static unsigned swappedOperator(unsigned op) {
+  switch (op) {
+    case '+':
+    case '*':
+    case TUPLE_TOKEN('=', '='):
+    case TUPLE_TOKEN('!', '='):
+    case TUPLE_TOKEN('&', '&'):
+    case TUPLE_TOKEN('|', '|'):
+      return op;
+    case '<': return '>';
+    case '>': return '<';
+    case TUPLE_TOKEN('<', '='): return TUPLE_TOKEN('>', '=');
+    case TUPLE_TOKEN('>', '='): return TUPLE_TOKEN('<', '=');
+    default: return 0;
+  }
+}
+
+static bool isIntConstant(AST::NodePtr node, int64_t &value) {
+  if (node->type != AST::Type::Number) {
+    return false;
+  }
+  auto number = AST::asNumber(node);
+  if (number->isFloat || number->value != (int32_t)number->value) {
+    return false;
+  }
+  value = (uint32_t)(int32_t)number->value;
+  return true;
+}
+
+// Emits the register form of an int operation if its operands allow it
+static bool generateRegisterOperation(Generator *gen, unsigned op, AST::NodePtr lhs, AST::NodePtr rhs) {
+  int64_t left, right;
+  if (!gen->registerFor(lhs, left)) {
+    // a constant lhs only works if the operands can be swapped
+    auto swapped = swappedOperator(op);
+    if (!swapped || !isIntConstant(lhs, right) || !gen->registerFor(rhs, left)) {
+      return false;
+    }
+    gen->emitOpcode(intRegisterOpcode(swapped, true));
+  } else if (gen->registerFor(rhs, right)) {
+    gen->emitOpcode(intRegisterOpcode(op, false));
+  } else if (isIntConstant(rhs, right)) {
+    gen->emitOpcode(intRegisterOpcode(op, true));
+  } else {
+    return false;
+  }
+  gen->write(left);
+  gen->write(right);
+  return true;
+}
+
 void BinaryOperation::generateBytecode(Generator *gen) {
+  if (isIntOperation && gen->m_useRegisters && generateRegisterOperation(gen, op, lhs, rhs)) {
+    return;
+  }
+
   rhs->generateBytecode(gen);
   lhs->generateBytecode(gen);
 
+  if (isIntOperation) {
+    gen->emitOpcode(intBinaryOpcode(op));
+    return;
+  }
+
+  if (isFloatOperation) {
+    gen->emitOpcode(floatBinaryOpcode(op));
+    return;
+  }
+
   auto opstr = std::string(reinterpret_cast<char *>(&op));
 
   gen->emitOpcode(Opcode::lookup);
   gen->write(gen->uniqueString(opstr));
   gen->write(gen->lookupID++);
 
-  gen->emitOpcode(Opcode::call);
-  gen->write(2);
+  gen->emitCall(2);
 }
 
 void UnaryOperation::generateBytecode(Generator *gen) {
   operand->generateBytecode(gen);
 
+  if (isIntOperation) {
+    gen->emitOpcode(op == '!' ? Opcode::not_i32 : Opcode::neg_i32);
+    return;
+  }
+
+  if (isFloatOperation) {
+    gen->emitOpcode(Opcode::neg_f64);
+    return;
+  }
+
   auto opstr = "unary_" + std::string(reinterpret_cast<char *>(&op));
 
   gen->emitOpcode(Opcode::lookup);
   gen->write(gen->uniqueString(opstr));
   gen->write(gen->lookupID++);
 
-  gen->emitOpcode(Opcode::call);
-  gen->write(1);
+  gen->emitCall(1);
 }
 
 void Match::generateBytecode(Generator *gen) {
-  auto size = cases.size();
-  long long pos[size - 1];
-  for (unsigned i = 0; i < size; i++) {
-    auto kase = cases[i];
+  // a scrutinee that isn't allocated selects its case statically, and the
+  // case's values name the object's slots
+  unsigned tag;
+  if (gen->scalarTag(value, tag)) {
+    for (auto kase : cases) {
+      if (kase->pattern->tag != tag) {
+        continue;
+      }
 
-    value->generateBytecode(gen);
+      ScalarObject object;
+      if (gen->scalarObject(value, kase->pattern->values.size(), object)) {
+        for (unsigned j = 0; j < kase->pattern->values.size(); j++) {
+          gen->m_slots[kase->pattern->values[j]->name] = object.slots[j];
+        }
+        kase->body->generateBytecode(gen);
+        return;
+      }
+      break;
+    }
+  }
 
-    gen->emitOpcode(Opcode::obj_load);
-    gen->write(-1);
+  auto scrutinee = gen->stackSlot++;
+  value->generateBytecode(gen);
+  gen->emitOpcode(Opcode::stack_store);
+  gen->write(scrutinee);
+  gen->emitOpcode(Opcode::stack_load);
+  gen->write(scrutinee);
 
-    gen->emitOpcode(Opcode::push);
-    gen->write(kase->pattern->tag);
+  unsigned size = 0;
+  for (auto kase : cases) {
+    size = std::max(size, kase->pattern->tag + 1);
+  }
 
-    std::string fnName = std::string("==");
-    gen->emitOpcode(Opcode::lookup);
-    gen->write(gen->uniqueString(fnName));
-    gen->write(gen->lookupID++);
-    gen->emitOpcode(Opcode::call);
-    gen->write(2);
+  // the jump table is filled in once the position of every case is known
+  int64_t start = gen->m_output.tellp();
+  gen->emitOpcode(Opcode::switch_tag);
+  gen->write(size);
+  int64_t table = gen->m_output.tellp();
+  for (unsigned i = 0; i < size; i++) {
+    gen->write(0);
+  }
 
-    gen->emitOpcode(Opcode::jz);
-    auto offset = gen->m_output.tellp();
+  std::vector<int64_t> exits;
+  auto emitExit = [&]() {
+    gen->emitOpcode(Opcode::jmp);
+    exits.push_back(gen->m_output.tellp());
     gen->write(0);
+  };
+
+  // tags without a case fall through the table and skip the whole match
+  emitExit();
+
+  std::vector<int64_t> targets(size, 0);
+  for (unsigned i = 0; i < cases.size(); i++) {
+    auto kase = cases[i];
+    auto tag = kase->pattern->tag;
+    if (!targets[tag]) {
+      targets[tag] = (int64_t)gen->m_output.tellp() - start;
+    }
+
     for (unsigned j = 0; j < kase->pattern->values.size(); j++) {
       auto slot = gen->stackSlot++;
       gen->m_slots[kase->pattern->values[j]->name] = slot;
-      value->generateBytecode(gen);
+      gen->emitOpcode(Opcode::stack_load);
+      gen->write(scrutinee);
       gen->emitOpcode(Opcode::obj_load);
       gen->write(j);
       gen->emitOpcode(Opcode::stack_store);
       gen->write(slot);
     }
     kase->body->generateBytecode(gen);
-    auto end = gen->m_output.tellp();
-    gen->m_output.seekp(offset);
-
-    unsigned extra = WORD_SIZE;
-    auto jmp = i < size - 1;
-    if (jmp) {
-      extra += 2 * WORD_SIZE;
-    }
-
-    gen->write((unsigned)(end - offset) + extra);
-    gen->m_output.seekp(end);
 
-    if (jmp) {
-      gen->emitOpcode(Opcode::jmp);
-      pos[i] = gen->m_output.tellp();
-      gen->write(0);
+    if (i < cases.size() - 1) {
+      emitExit();
     }
   }
 
-  auto p = gen->m_output.tellp();
-  for (unsigned i = 0; i < size - 1; i++) {
-    gen->m_output.seekp(pos[i] );
-    unsigned off = p - pos[i];
-    gen->write(off + WORD_SIZE);
+  int64_t end = gen->m_output.tellp();
+  for (unsigned tag = 0; tag < size; tag++) {
+    gen->m_output.seekp(table + tag * WORD_SIZE);
+    gen->write(targets[tag] ? targets[tag] : end - start);
   }
-  gen->m_output.seekp(p);
+  // jump offsets are relative to the opcode, one word before the operand
+  for (auto exit : exits) {
+    gen->m_output.seekp(exit);
+    gen->write(end - exit + WORD_SIZE);
+  }
+  gen->m_output.seekp(end);
 }
 
 void Let::generateBytecode(Generator *gen) {
@@ -333,46 +1081,72 @@ void Let::generateBytecode(Generator *gen) {
   }
 
   block->generateBytecode(gen);
-}
 
-static void handleCapture(AST::IdentifierPtr ident, unsigned stackSlot, Generator *gen) {
-  if (ident->isCaptured) {
-    gen->emitOpcode(Opcode::stack_load);
-    gen->write(stackSlot);
-    gen->emitOpcode(Opcode::put_to_scope);
-    gen->write(gen->uniqueString(ident->name));
+  for (auto assignment : assignments) {
+    if (gen->m_scalarReplaced.count(assignment.get())) {
+      gen->m_scalars.erase(AST::asIdentifier(assignment->left)->name);
+    }
   }
 }
 
+
 void Assignment::generateBytecode(Generator *gen) {
   if (left->type == AST::Type::Identifier) {
     auto ident = AST::asIdentifier(left);
+    if (gen->m_scalarReplaced.count(this)) {
+      ScalarObject object;
+      gen->scalarObject(value, AST::asConstructor(value)->size, object);
+      gen->m_scalars[ident->name] = object;
+      return;
+    }
+
     auto slot = gen->stackSlot++;
     value->generateBytecode(gen);
     gen->m_slots[ident->name] = slot;
     gen->emitOpcode(Opcode::stack_store);
     gen->write(slot);
-
-    handleCapture(ident, slot, gen);
   } else if (left->type == AST::Type::Pattern) {
     auto pattern = AST::asPattern(left);
+    auto &values = pattern->values;
+
+    unsigned tag;
+    ScalarObject object;
+    if (gen->scalarTag(value, tag) && tag == pattern->tag && gen->scalarObject(value, values.size(), object)) {
+      for (unsigned i = 0; i < values.size(); i++) {
+        gen->m_slots[values[i]->name] = object.slots[i];
+      }
+      return;
+    }
+
+    std::vector<unsigned> slots;
+    for (unsigned i = 0; i < values.size(); i++) {
+      slots.push_back(gen->stackSlot++);
+    }
+
+    // the object is evaluated once and kept in the slot of the first value,
+    // which is loaded last
     value->generateBytecode(gen);
+    if (slots.size()) {
+      gen->emitOpcode(Opcode::stack_store);
+      gen->write(slots[0]);
+      gen->emitOpcode(Opcode::stack_load);
+      gen->write(slots[0]);
+    }
 
     gen->emitOpcode(Opcode::obj_tag_test);
     gen->write(pattern->tag);
 
-    for (unsigned i = 0; i < pattern->values.size(); i++) {
-      value->generateBytecode(gen);
+    for (unsigned i = slots.size(); i-- > 0;) {
+      gen->emitOpcode(Opcode::stack_load);
+      gen->write(slots[0]);
       gen->emitOpcode(Opcode::obj_load);
       gen->write(i);
-
-      auto slot = gen->stackSlot++;
-      auto ident = pattern->values[i];
-      gen->m_slots[ident->name] = slot;
       gen->emitOpcode(Opcode::stack_store);
-      gen->write(slot);
+      gen->write(slots[i]);
+    }
 
-      handleCapture(ident, slot, gen);
+    for (unsigned i = 0; i < values.size(); i++) {
+      gen->m_slots[values[i]->name] = slots[i];
     }
   } else {
     assert(false);
@@ -392,13 +1166,31 @@ void Constructor::generateBytecode(Generator *gen) {
 }
 
 void Function::generateBytecode(Generator *gen) {
+  auto fnID = gen->m_functions.size();
+  for (auto capture : captures) {
+    gen->loadCaptured(capture);
+  }
   gen->emitOpcode(Opcode::create_closure);
-  gen->write(gen->m_functions.size());
-  gen->write(capturesScope);
+  gen->write(fnID);
+  gen->write(captures.size());
+
   if (name != "_") {
-    gen->emitOpcode(Opcode::bind);
     auto name = namespaced(ns, this->name);
-    gen->write(gen->uniqueString(name));
+    if (declaration) {
+      auto slot = gen->stackSlot++;
+      gen->m_slots[declaration->name] = slot;
+      gen->emitOpcode(Opcode::stack_store);
+      gen->write(slot);
+    } else {
+      gen->emitOpcode(Opcode::bind);
+      gen->write(gen->uniqueString(name));
+    }
+
+    // Calls generated from now on can jump straight into the function, as
+    // long as nothing else can ever be bound to its name
+    if (!captures.size() && gen->m_functionBindings[name] == 1 && !gen->m_localBindings.count(name)) {
+      gen->m_directCalls[name] = fnID;
+    }
   }
   gen->m_functions.push_back(this);
 }
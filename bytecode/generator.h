@@ -1,25 +1,60 @@
 #include <fstream>
 #include <sstream>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "parser/ast.h"
 #include "opcodes.h"
+#include "peephole.h"
 
 #pragma once
 
 namespace Verve {
 
+  // object that is never allocated, each field lives in its own stack slot
+  struct ScalarObject {
+    unsigned tag;
+    std::vector<unsigned> slots;
+  };
+
+  // a function of the Functions section, see sections.h
+  struct FunctionEntry {
+    unsigned name;
+    std::vector<unsigned> args;
+    // offset of the code from the start of the Code section, in bytes
+    int64_t offset;
+    int64_t length;
+  };
+
   struct Generator {
-      Generator(AST::ProgramPtr ast, bool shouldLink) :
-        m_ast(ast),
-        m_shouldLink(shouldLink) {}
+      Generator(AST::ProgramPtr ast) :
+        m_ast(ast) {}
 
       std::stringstream &generate(void);
-      void generateFunctionSource(AST::Function *fn);
+      void generateFunctionSource(AST::Function *fn, unsigned fnID);
+      void collectBindings(AST::NodePtr node);
+      void collectCaptures(AST::NodePtr node, std::vector<AST::Function *> &functions);
+      void loadCaptured(AST::Identifier *declaration);
+      void markTailCalls(AST::NodePtr node);
+      void hoistSlots(AST::NodePtr node, AST::Block *frame);
+      void collectScalarReplacements(AST::NodePtr node, AST::Block *frame);
+      bool escapes(const std::string &name, AST::Constructor *object, AST::NodePtr node);
+      static bool mentions(const std::string &name, AST::NodePtr node);
+      static bool isIdentifier(AST::NodePtr node, const std::string &name);
+      static bool isCompleteConstructor(AST::NodePtr node);
+      bool scalarTag(AST::NodePtr value, unsigned &tag);
+      bool scalarObject(AST::NodePtr value, unsigned arity, ScalarObject &object);
+      void emitTailCallPrologue(void);
+      void optimizeCode(int64_t start);
+      void emitInstructions(const std::vector<Instruction> &);
 
       static void disassemble(std::stringstream &);
 
       void emitOpcode(Opcode::Type);
+      void emitCall(unsigned argc);
+      void fuse(Opcode::Type);
+      void rewriteOpcode(int64_t position, Opcode::Type);
+      bool registerFor(AST::NodePtr node, int64_t &reg);
       void emitJmp(Opcode::Type, AST::BlockPtr &);
       void emitJmp(Opcode::Type, AST::BlockPtr &, bool);
       void write(int64_t);
@@ -33,12 +68,42 @@ namespace Verve {
       std::stringstream m_output;
       std::vector<std::string> m_strings;
       std::vector<AST::Function *> m_functions;
+      std::vector<FunctionEntry> m_functionEntries;
       std::unordered_map<std::string, unsigned> m_slots;
-      bool m_shouldLink;
+      // function name => number of `fn` declarations binding it
+      std::unordered_map<std::string, unsigned> m_functionBindings;
+      // names bound by parameters, `let`s and patterns, which may shadow functions
+      std::unordered_set<std::string> m_localBindings;
+      // function name => function id, for functions that can't be shadowed
+      std::unordered_map<std::string, unsigned> m_directCalls;
+      // declaration => number of functions enclosing it
+      std::unordered_map<AST::Identifier *, unsigned> m_declarationLevels;
+      // `let`s of objects that don't escape, and the objects they bind
+      std::unordered_set<AST::Assignment *> m_scalarReplaced;
+      std::unordered_map<std::string, ScalarObject> m_scalars;
+      // sizes of the `stack_alloc`s active at the current position
+      std::vector<unsigned> m_stackAllocs;
+      bool m_useSuperinstructions = true;
+      // emit the register forms of int operations when their operands are
+      // arguments, locals or constants
+      bool m_useRegisters = true;
+      // start every function with a `jit_count`, so the JIT can find hot ones
+      bool m_countCalls = false;
+      // emit every function and the text unfused first, and fuse them once
+      // the peephole pass has removed their redundant instructions
+      bool m_usePeephole = false;
+      // encode the code compactly once it's been generated, see compact.h
+      bool m_useCompactEncoding = false;
+      // position and opcode of the last straight-line instructions emitted
+      std::vector<std::pair<int64_t, Opcode::Type>> m_straightLine;
 
       unsigned lookupID = 1;
+      // slot of the next `call` in VM::m_callCaches
+      unsigned callCacheID = 0;
       unsigned stackSlot = 0;
-      bool capturesScope = true;
+      // slots allocated by the current function, which sit right below its frame
+      unsigned frameSlots = 0;
+      AST::Function *currentFunction = nullptr;
   };
 
 }
@@ -1,29 +1,44 @@
 #include "utils/macros.h"
+#include "superinstructions.h"
 
 #pragma once
 
 #define WORD_SIZE 8
 
-#define OPCODE_ADDRESS(__op, _) (uintptr_t)op_##__op,
-
 #define EXTERN_OPCODE(opcode, _) \
   extern "C" void op_##opcode ();
 
+// `call argc, cacheSlot`: the slot is the call site's inline cache in
+// VM::m_callCaches, the last closure it called and the address of its code.
+// Once the site has seen a second closure it stops caching.
+#define CALL_CACHE_EMPTY 0
+#define CALL_CACHE_MEGAMORPHIC 1
+
+// The `_rr` and `_rk` forms of the int operations are the register tier:
+// instead of popping their operands they read them from the frame, as word
+// offsets from the frame pointer (registers), or from the bytecode
+// (constants), and push the result. The `_f64` operations work on doubles,
+// and only have the stack form.
 #define OPCODES \
       ret, 0, \
       bind, 1, \
       push, 1, \
-      call, 1, \
+      call, 2, \
+      call_direct, 2, \
+      tail_call, 1, \
+      tail_call_direct, 2, \
       jz, 1, \
       jmp, 1, \
+      switch_tag, 1, \
       create_closure, 2, \
       load_string, 1, \
       push_arg, 1, \
       lookup, 2, \
       exit, 0, \
-      create_lex_scope, 0, \
-      release_lex_scope, 0, \
-      put_to_scope, 1, \
+      jit_count, 1, \
+      jit_resume, 1, \
+      closure_load, 1, \
+      push_callee, 0, \
       alloc_obj, 2, \
       alloc_list, 1, \
       obj_store_at, 1, \
@@ -32,10 +47,135 @@
       stack_alloc, 1, \
       stack_store, 1, \
       stack_load, 1, \
-      stack_free, 1
+      stack_free, 1, \
+      stack_unwind, 1, \
+      add_i32, 0, \
+      sub_i32, 0, \
+      mul_i32, 0, \
+      div_i32, 0, \
+      mod_i32, 0, \
+      lt_i32, 0, \
+      gt_i32, 0, \
+      lte_i32, 0, \
+      gte_i32, 0, \
+      eq_i32, 0, \
+      ne_i32, 0, \
+      and_i32, 0, \
+      or_i32, 0, \
+      not_i32, 0, \
+      neg_i32, 0, \
+      add_i32_rr, 2, \
+      sub_i32_rr, 2, \
+      mul_i32_rr, 2, \
+      div_i32_rr, 2, \
+      mod_i32_rr, 2, \
+      lt_i32_rr, 2, \
+      gt_i32_rr, 2, \
+      lte_i32_rr, 2, \
+      gte_i32_rr, 2, \
+      eq_i32_rr, 2, \
+      ne_i32_rr, 2, \
+      and_i32_rr, 2, \
+      or_i32_rr, 2, \
+      add_i32_rk, 2, \
+      sub_i32_rk, 2, \
+      mul_i32_rk, 2, \
+      div_i32_rk, 2, \
+      mod_i32_rk, 2, \
+      lt_i32_rk, 2, \
+      gt_i32_rk, 2, \
+      lte_i32_rk, 2, \
+      gte_i32_rk, 2, \
+      eq_i32_rk, 2, \
+      ne_i32_rk, 2, \
+      and_i32_rk, 2, \
+      or_i32_rk, 2, \
+      add_f64, 0, \
+      sub_f64, 0, \
+      mul_f64, 0, \
+      div_f64, 0, \
+      lt_f64, 0, \
+      gt_f64, 0, \
+      lte_f64, 0, \
+      gte_f64, 0, \
+      eq_f64, 0, \
+      ne_f64, 0, \
+      neg_f64, 0, \
+      SUPERINSTRUCTION_OPCODES
+
+// Opcodes that never jump: both interpreters define their handlers as a body
+// followed by a dispatch, so they can start a superinstruction.
+#define STRAIGHT_LINE_OPCODES \
+      push, 1, \
+      load_string, 1, \
+      push_arg, 1, \
+      closure_load, 1, \
+      push_callee, 0, \
+      obj_load, 1, \
+      stack_store, 1, \
+      stack_load, 1, \
+      add_i32, 0, \
+      sub_i32, 0, \
+      mul_i32, 0, \
+      div_i32, 0, \
+      mod_i32, 0, \
+      lt_i32, 0, \
+      gt_i32, 0, \
+      lte_i32, 0, \
+      gte_i32, 0, \
+      eq_i32, 0, \
+      ne_i32, 0, \
+      and_i32, 0, \
+      or_i32, 0, \
+      not_i32, 0, \
+      neg_i32, 0, \
+      add_i32_rr, 2, \
+      sub_i32_rr, 2, \
+      mul_i32_rr, 2, \
+      div_i32_rr, 2, \
+      mod_i32_rr, 2, \
+      lt_i32_rr, 2, \
+      gt_i32_rr, 2, \
+      lte_i32_rr, 2, \
+      gte_i32_rr, 2, \
+      eq_i32_rr, 2, \
+      ne_i32_rr, 2, \
+      and_i32_rr, 2, \
+      or_i32_rr, 2, \
+      add_i32_rk, 2, \
+      sub_i32_rk, 2, \
+      mul_i32_rk, 2, \
+      div_i32_rk, 2, \
+      mod_i32_rk, 2, \
+      lt_i32_rk, 2, \
+      gt_i32_rk, 2, \
+      lte_i32_rk, 2, \
+      gte_i32_rk, 2, \
+      eq_i32_rk, 2, \
+      ne_i32_rk, 2, \
+      and_i32_rk, 2, \
+      or_i32_rk, 2, \
+      add_f64, 0, \
+      sub_f64, 0, \
+      mul_f64, 0, \
+      div_f64, 0, \
+      lt_f64, 0, \
+      gt_f64, 0, \
+      lte_f64, 0, \
+      gte_f64, 0, \
+      eq_f64, 0, \
+      ne_f64, 0, \
+      neg_f64, 0,
+
+#ifndef __ASSEMBLER__
+
+#include <cstdint>
 
 EVAL(MAP_2(EXTERN_OPCODE, OPCODES))
 
+// the handlers of the assembly interpreter, indexed by opcode
+extern "C" const uintptr_t dispatch_table[];
+
 #define FIRST_WITH_COMMA(F, ...) F,
 #define SECOND_WITH_COMMA(_, S, ...) S,
 
@@ -46,17 +186,39 @@ class Opcode {
 
   EVAL(ENUM(Type, MAP_2(FIRST_WITH_COMMA, OPCODES)));
 
-  static uintptr_t address(Opcode::Type t) {
-    return (uintptr_t []) {
-      EVAL(MAP_2(OPCODE_ADDRESS, OPCODES))
-    }[(int)t];
-  }
-
   static unsigned size(Opcode::Type t) {
     return (unsigned []) {
       EVAL(MAP_2(SECOND_WITH_COMMA, OPCODES))
     }[(int)t];
   }
+
+  // A superinstruction takes the place of the opcode of its first component
+  // and leaves the rest of the sequence untouched, so it has the same
+  // operands and jumps into the middle of it still work.
+  static Opcode::Type firstComponent(Opcode::Type t) {
+#define FIRST_COMPONENT_2(__name, __a, _, __b) case __name: return __a;
+#define FIRST_COMPONENT_3(__name, __a, _, __b, __, __c) case __name: return __a;
+    switch (t) {
+      SUPERINSTRUCTIONS_2(FIRST_COMPONENT_2)
+      SUPERINSTRUCTIONS_3(FIRST_COMPONENT_3)
+      default: return t;
+    }
+#undef FIRST_COMPONENT_2
+#undef FIRST_COMPONENT_3
+  }
+
+  static bool isStraightLine(Opcode::Type t) {
+#define STRAIGHT_LINE_CASE(__op, _) case __op:
+    switch (t) {
+      EVAL(MAP_2(STRAIGHT_LINE_CASE, STRAIGHT_LINE_OPCODES))
+        return true;
+      default:
+        return false;
+    }
+#undef STRAIGHT_LINE_CASE
+  }
 };
 
 }
+
+#endif
@@ -0,0 +1,260 @@
+#include "peephole.h"
+
+#include <algorithm>
+#include <cassert>
+#include <unordered_map>
+
+namespace Verve {
+
+  Peephole::Peephole(const std::string &code, unsigned frameSlots) :
+    m_frameSlots(frameSlots)
+  {
+    decode(code);
+  }
+
+  // Jump offsets are relative to the opcode of the jump, and so are the
+  // entries of the table of a `switch_tag`
+  void Peephole::decode(const std::string &code) {
+    assert(code.size() % WORD_SIZE == 0);
+    auto words = (const int64_t *)code.data();
+    auto size = code.size() / WORD_SIZE;
+
+    std::unordered_map<size_t, size_t> indices;
+    std::vector<std::vector<int64_t>> offsets;
+    for (size_t word = 0; word < size;) {
+      indices[word] = m_instructions.size();
+
+      Instruction instruction;
+      instruction.opcode = (Opcode::Type)words[word];
+      for (unsigned i = 1; i <= Opcode::size(instruction.opcode); i++) {
+        instruction.operands.push_back(words[word + i]);
+      }
+
+      std::vector<int64_t> targets;
+      auto next = word + 1 + Opcode::size(instruction.opcode);
+      if (instruction.opcode == Opcode::switch_tag) {
+        for (int64_t i = 0; i < instruction.operands[0]; i++) {
+          targets.push_back(word * WORD_SIZE + words[next++]);
+        }
+      } else if (isJump(instruction.opcode)) {
+        targets.push_back(word * WORD_SIZE + instruction.operands[0]);
+      }
+
+      offsets.push_back(targets);
+      m_instructions.push_back(instruction);
+      word = next;
+    }
+    indices[size] = m_instructions.size();
+
+    for (size_t i = 0; i < m_instructions.size(); i++) {
+      for (auto offset : offsets[i]) {
+        assert(offset % WORD_SIZE == 0 && indices.count(offset / WORD_SIZE));
+        m_instructions[i].targets.push_back(indices[offset / WORD_SIZE]);
+      }
+    }
+  }
+
+  void Peephole::optimize() {
+    do {
+      threadJumps();
+    } while (removeRedundancies());
+  }
+
+  void Peephole::threadJumps() {
+    auto size = m_instructions.size();
+    for (auto &instruction : m_instructions) {
+      for (auto &target : instruction.targets) {
+        // a loop of `jmp`s stops after going around once
+        for (size_t i = 0; i < size && target < size && m_instructions[target].opcode == Opcode::jmp; i++) {
+          target = m_instructions[target].targets[0];
+        }
+      }
+    }
+  }
+
+  // Returns whether any instruction was removed
+  bool Peephole::removeRedundancies() {
+    auto size = m_instructions.size();
+    m_removed.assign(size, false);
+    m_incomingJumps.assign(size + 1, 0);
+    for (auto &instruction : m_instructions) {
+      for (auto target : instruction.targets) {
+        m_incomingJumps[target]++;
+      }
+    }
+    collectSlotReads();
+
+    bool removed = removeUnusedFrame();
+    auto remove = [&](size_t index) {
+      m_removed[index] = true;
+      removed = true;
+    };
+
+    for (size_t i = 0; i < size; i++) {
+      auto &instruction = m_instructions[i];
+      auto opcode = instruction.opcode;
+      if (m_removed[i]) {
+        continue;
+      }
+
+      if (opcode == Opcode::jmp) {
+        auto target = instruction.targets[0];
+        if (target == i + 1) {
+          remove(i);
+        } else if (target < size && m_instructions[target].opcode == Opcode::ret) {
+          instruction = m_instructions[target];
+          removed = true;
+        }
+      }
+
+      // nothing falls through to the instructions that follow
+      if (opcode == Opcode::jmp || opcode == Opcode::ret || opcode == Opcode::exit) {
+        while (i + 1 < size && !isJumpTarget(i + 1)) {
+          remove(++i);
+        }
+        continue;
+      }
+
+      if (i + 1 == size || isJumpTarget(i + 1)) {
+        continue;
+      }
+      auto &next = m_instructions[i + 1];
+
+      if (next.opcode == Opcode::stack_store && isPush(opcode) && !slotReads(next.operands[0])) {
+        remove(i);
+        remove(++i);
+      } else if (opcode == Opcode::stack_store && next.opcode == Opcode::stack_load &&
+          instruction.operands[0] == next.operands[0] &&
+          slotReads(instruction.operands[0]) == 1) {
+        remove(i);
+        remove(++i);
+      } else if (opcode == Opcode::push && next.opcode == Opcode::jz) {
+        // `jz` tests the whole word
+        if (instruction.operands[0]) {
+          remove(i);
+        } else {
+          instruction.opcode = Opcode::jmp;
+          instruction.operands = next.operands;
+          instruction.targets = next.targets;
+        }
+        remove(++i);
+      }
+    }
+
+    if (removed) {
+      compact();
+    }
+    return removed;
+  }
+
+  // The frame of a function whose slots are never used is dropped, along
+  // with the `stack_unwind`s before its tail calls. Only code with a single
+  // frame is considered, so every `stack_free` and `stack_unwind` is its own
+  bool Peephole::removeUnusedFrame() {
+    if (std::any_of(m_slotReads.begin(), m_slotReads.end(), [](unsigned reads) { return reads > 0; })) {
+      return false;
+    }
+
+    std::vector<size_t> frame;
+    unsigned allocs = 0;
+    for (size_t i = 0; i < m_instructions.size(); i++) {
+      auto opcode = m_instructions[i].opcode;
+      if (opcode == Opcode::stack_store) {
+        return false;
+      }
+      if (opcode == Opcode::stack_alloc || opcode == Opcode::stack_free || opcode == Opcode::stack_unwind) {
+        allocs += opcode == Opcode::stack_alloc;
+        frame.push_back(i);
+      }
+    }
+    if (allocs != 1) {
+      return false;
+    }
+
+    for (auto i : frame) {
+      m_removed[i] = true;
+    }
+    return true;
+  }
+
+  bool Peephole::isPush(Opcode::Type opcode) {
+    switch (opcode) {
+      case Opcode::push:
+      case Opcode::push_arg:
+      case Opcode::load_string:
+      case Opcode::closure_load:
+      case Opcode::push_callee:
+      case Opcode::stack_load:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  bool Peephole::isJumpTarget(size_t index) {
+    return m_incomingJumps[index] > 0;
+  }
+
+  unsigned Peephole::slotReads(int64_t slot) {
+    return (size_t)slot < m_slotReads.size() ? m_slotReads[slot] : 0;
+  }
+
+  // Counts the reads of every slot, by `stack_load` or as a register operand
+  void Peephole::collectSlotReads() {
+    m_slotReads.clear();
+    auto read = [&](int64_t slot) {
+      if (slot < 0) {
+        return;
+      }
+      if ((size_t)slot >= m_slotReads.size()) {
+        m_slotReads.resize(slot + 1, 0);
+      }
+      m_slotReads[slot]++;
+    };
+
+    for (auto &instruction : m_instructions) {
+      auto opcode = instruction.opcode;
+      unsigned registers = 0;
+      if (opcode >= Opcode::add_i32_rr && opcode <= Opcode::or_i32_rr) {
+        registers = 2;
+      } else if (opcode >= Opcode::add_i32_rk && opcode <= Opcode::or_i32_rk) {
+        registers = 1;
+      }
+
+      if (opcode == Opcode::stack_load) {
+        read(instruction.operands[0]);
+      }
+      for (unsigned i = 0; i < registers; i++) {
+        // arguments are the registers above the frame pointer
+        if (instruction.operands[i] < 0) {
+          read(instruction.operands[i] + 1 + m_frameSlots);
+        }
+      }
+    }
+  }
+
+  // Drops the removed instructions, and sends the jumps to them to the next
+  // instruction that's left
+  void Peephole::compact() {
+    auto size = m_instructions.size();
+    std::vector<size_t> indices(size + 1);
+    indices[size] = size - std::count(m_removed.begin(), m_removed.end(), true);
+    for (size_t i = size; i-- > 0;) {
+      indices[i] = m_removed[i] ? indices[i + 1] : indices[i + 1] - 1;
+    }
+
+    std::vector<Instruction> instructions;
+    for (size_t i = 0; i < size; i++) {
+      if (m_removed[i]) {
+        continue;
+      }
+      auto &instruction = m_instructions[i];
+      for (auto &target : instruction.targets) {
+        target = indices[target];
+      }
+      instructions.push_back(std::move(instruction));
+    }
+    m_instructions = std::move(instructions);
+  }
+
+}
@@ -0,0 +1,64 @@
+#include <string>
+#include <vector>
+
+#include "opcodes.h"
+
+#pragma once
+
+namespace Verve {
+
+  // A decoded instruction. Jumps refer to their targets by index, so the
+  // instructions around them can be removed without breaking their offsets.
+  struct Instruction {
+    Opcode::Type opcode;
+    std::vector<int64_t> operands;
+    // the instructions `jz` and `jmp` jump to, or the entries of the table of
+    // a `switch_tag`. The index past the last instruction is the end of the code
+    std::vector<size_t> targets;
+  };
+
+  // Removes redundant instructions from the code of a function, or from the
+  // text, once it has been generated:
+  //   - a `stack_store` followed by a `stack_load` of the same slot, when
+  //     nothing else reads the slot: the value stays on the stack
+  //   - a push followed by a `stack_store` to a slot that's never read
+  //   - a `jmp` to the next instruction, and the code after a `jmp`, `ret` or
+  //     `exit` that nothing jumps to
+  //   - a frame whose slots are never used
+  //   - a `jz` over a constant: it never jumps or it's a `jmp`
+  // Jumps to a `jmp` go straight to its target, and a `jmp` to a `ret` is
+  // replaced by it. Removing an instruction sends the jumps to it to the one
+  // that follows.
+  class Peephole {
+    public:
+      // `code` is unlinked and has no superinstructions. Registers below the
+      // frame pointer are the slots of a frame of `frameSlots` slots
+      Peephole(const std::string &code, unsigned frameSlots);
+
+      void optimize();
+
+      std::vector<Instruction> &instructions() { return m_instructions; }
+
+      static bool isJump(Opcode::Type opcode) {
+        return opcode == Opcode::jz || opcode == Opcode::jmp || opcode == Opcode::switch_tag;
+      }
+
+    private:
+      void decode(const std::string &code);
+      bool removeRedundancies();
+      bool removeUnusedFrame();
+      void threadJumps();
+      void compact();
+      void collectSlotReads();
+      bool isJumpTarget(size_t index);
+      unsigned slotReads(int64_t slot);
+      static bool isPush(Opcode::Type opcode);
+
+      std::vector<Instruction> m_instructions;
+      std::vector<bool> m_removed;
+      std::vector<unsigned> m_incomingJumps;
+      std::vector<unsigned> m_slotReads;
+      unsigned m_frameSlots;
+  };
+
+}
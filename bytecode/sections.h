@@ -2,13 +2,36 @@
 
 #pragma once
 
+// Bytecode starts with a table of contents, so every section can be found
+// without reading the ones before it. All sizes are in words unless noted:
+//   Header, Version, Encoding of the code (see compact.h), number of sections
+//   for each section: its type, and its offset and length in bytes from the
+//   start of the bytecode
+//   Strings:   number of strings, the offset in bytes of each one from the
+//              start of the section, then the strings, NUL terminated and
+//              padded to a word
+//   Functions: number of functions, an entry of `FunctionEntrySize` words for
+//              each: its name (a string id), number of arguments, index of
+//              its first argument in the list of argument names that
+//              follows, and offset and length in bytes of its code
+//   Code:      the code of every function, padded to a word
+//   Text:      size of the lookup table, number of call caches, and the code
+//              of the program
 struct Section {
   static int const Header = 0xCE05;
-  static int const FunctionHeader = 0xCE0F;
+  static int const Version = 3;
+
+  static unsigned const FunctionEntrySize = 5;
+
+  ENUM(Encoding,
+    Wide,
+    Compact,
+  );
 
   ENUM(Type,
     Strings,
     Functions,
+    Code,
     Text,
   );
 };
@@ -0,0 +1,45 @@
+// Generated by `make superinstructions` from an opcode profile, do not edit.
+
+#pragma once
+
+// name, number of operands of the first component
+#define SUPERINSTRUCTION_OPCODES \
+      super_sub_i32_rk_call_direct, 2, \
+      super_lt_i32_rk_jz, 2, \
+      super_add_i32_ret, 0, \
+      super_push_arg_jmp, 1, \
+      super_add_i32_rk_sub_i32_rk_tail_call_direct, 2, \
+      super_add_i32_rk_push_arg_sub_i32_rr, 2, \
+      super_push_arg_sub_i32_rr_tail_call_direct, 1, \
+      super_eq_i32_rk_jz, 2, \
+      super_sub_i32_rk_tail_call_direct, 2, \
+      super_add_i32_rk_sub_i32_rk, 2, \
+      super_lte_i32_rk_jz, 2, \
+      super_add_i32_rk_push_arg, 2, \
+      super_push_arg_sub_i32_rr, 1, \
+      super_sub_i32_rr_tail_call_direct, 2, \
+      super_stack_load_obj_load_stack_store, 1, \
+      super_stack_store_stack_load_switch_tag, 1, \
+
+// X(name, first, its number of operands, last)
+#define SUPERINSTRUCTIONS_2(X) \
+  X(super_sub_i32_rk_call_direct, sub_i32_rk, 2, call_direct) \
+  X(super_lt_i32_rk_jz, lt_i32_rk, 2, jz) \
+  X(super_add_i32_ret, add_i32, 0, ret) \
+  X(super_push_arg_jmp, push_arg, 1, jmp) \
+  X(super_eq_i32_rk_jz, eq_i32_rk, 2, jz) \
+  X(super_sub_i32_rk_tail_call_direct, sub_i32_rk, 2, tail_call_direct) \
+  X(super_add_i32_rk_sub_i32_rk, add_i32_rk, 2, sub_i32_rk) \
+  X(super_lte_i32_rk_jz, lte_i32_rk, 2, jz) \
+  X(super_add_i32_rk_push_arg, add_i32_rk, 2, push_arg) \
+  X(super_push_arg_sub_i32_rr, push_arg, 1, sub_i32_rr) \
+  X(super_sub_i32_rr_tail_call_direct, sub_i32_rr, 2, tail_call_direct) \
+
+// X(name, first, its number of operands, second, its number of operands, last)
+#define SUPERINSTRUCTIONS_3(X) \
+  X(super_add_i32_rk_sub_i32_rk_tail_call_direct, add_i32_rk, 2, sub_i32_rk, 2, tail_call_direct) \
+  X(super_add_i32_rk_push_arg_sub_i32_rr, add_i32_rk, 2, push_arg, 1, sub_i32_rr) \
+  X(super_push_arg_sub_i32_rr_tail_call_direct, push_arg, 1, sub_i32_rr, 2, tail_call_direct) \
+  X(super_stack_load_obj_load_stack_store, stack_load, 1, obj_load, 1, stack_store) \
+  X(super_stack_store_stack_load_switch_tag, stack_store, 1, stack_load, 1, switch_tag) \
+
@@ -4,7 +4,9 @@
 #include "token.h"
 
 #include <cassert>
+#include <functional>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -54,6 +56,7 @@ static unsigned str_uid = 0;
 
 namespace Verve {
   struct Generator;
+  struct TypeInterface;
 
 namespace AST {
   ENUM_CLASS(Type, AST_TYPES)
@@ -72,12 +75,16 @@ namespace AST {
     virtual ::Verve::Type *typeof(__unused EnvPtr env) {
       throw std::runtime_error("Trying to get type for virtual node");
     }
+
+    // calls `visitor` with each of the node's direct children
+    virtual void visit(__unused std::function<void(NodePtr)> visitor) {}
   };
 
   struct Program : public Node {
     using Node::Node;
 
     virtual void generateBytecode(Generator *gen);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     BlockPtr body;
   };
@@ -87,6 +94,7 @@ namespace AST {
 
     virtual void generateBytecode(Generator *gen);
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     std::vector<NodePtr> nodes;
     unsigned stackSlots = 0;
@@ -111,7 +119,9 @@ namespace AST {
 
     std::string name;
     std::string ns;
-    bool isCaptured;
+
+    // set on references to a declaration of an enclosing function
+    Identifier *binding = nullptr;
   };
 
   struct String : public Identifier {
@@ -134,9 +144,17 @@ namespace AST {
 
     virtual void generateBytecode(Generator *gen);
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     NodePtr callee;
     std::vector<NodePtr> arguments;
+    bool isTailCall = false;
+    // calls to a function of `interface` that no implementation provides for
+    // `implementationType`, the type the interface is used with. Inside the
+    // interface's own functions the type is only known once they are
+    // specialized, and is left empty
+    TypeInterface *interface = nullptr;
+    std::string implementationType;
   };
 
   struct Function : public Node {
@@ -144,14 +162,17 @@ namespace AST {
 
     virtual void generateBytecode(Generator *gen);
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     std::string originalName;
     std::string name;
     std::string ns;
     std::vector<FunctionParameterPtr> parameters;
     BlockPtr body;
-    bool needsScope;
-    bool capturesScope;
+    // binds the function's name, for functions declared inside others
+    IdentifierPtr declaration;
+    // declarations of enclosing functions copied into the closure
+    std::vector<Identifier *> captures;
   };
 
   struct If : public Node {
@@ -159,6 +180,7 @@ namespace AST {
 
     virtual void generateBytecode(Generator *gen);
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     NodePtr condition;
     BlockPtr ifBody;
@@ -170,10 +192,13 @@ namespace AST {
 
     virtual void generateBytecode(Generator *gen);
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     unsigned op;
     NodePtr lhs;
     NodePtr rhs;
+    bool isIntOperation = false;
+    bool isFloatOperation = false;
   };
 
   struct UnaryOperation : public Node {
@@ -181,9 +206,12 @@ namespace AST {
 
     virtual void generateBytecode(Generator *gen);
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     unsigned op;
     NodePtr operand;
+    bool isIntOperation = false;
+    bool isFloatOperation = false;
   };
 
   struct List : public Node {
@@ -191,6 +219,7 @@ namespace AST {
 
     virtual void generateBytecode(Generator *gen);
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     std::vector<NodePtr> items;
   };
@@ -201,6 +230,7 @@ namespace AST {
     virtual void generateBytecode(__unused Generator *gen) {
       throw std::runtime_error("Implemented inline");
     }
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     unsigned tag;
     std::string constructorName;
@@ -214,6 +244,7 @@ namespace AST {
       throw std::runtime_error("Implemented inline");
     }
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     PatternPtr pattern;
     BlockPtr body;
@@ -224,6 +255,7 @@ namespace AST {
 
     virtual void generateBytecode(Generator *gen);
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     NodePtr value;
     std::vector<CasePtr> cases;
@@ -234,6 +266,7 @@ namespace AST {
 
     virtual void generateBytecode(Generator *gen);
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     NodePtr left;
     NodePtr value;
@@ -244,6 +277,7 @@ namespace AST {
 
     virtual void generateBytecode(Generator *gen);
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     std::vector<AssignmentPtr> assignments;
     BlockPtr block;
@@ -255,6 +289,7 @@ namespace AST {
 
     virtual void generateBytecode(Generator *gen);
     virtual ::Verve::Type *typeof(EnvPtr env);
+    virtual void visit(std::function<void(NodePtr)> visitor);
 
     std::string name;
     std::vector<NodePtr> arguments;
@@ -262,6 +297,71 @@ namespace AST {
     unsigned size;
   };
 
+  inline void Program::visit(std::function<void(NodePtr)> visitor) {
+    visitor(body);
+  }
+
+  inline void Block::visit(std::function<void(NodePtr)> visitor) {
+    for (auto node : nodes) visitor(node);
+  }
+
+  inline void Call::visit(std::function<void(NodePtr)> visitor) {
+    visitor(callee);
+    for (auto arg : arguments) visitor(arg);
+  }
+
+  inline void Function::visit(std::function<void(NodePtr)> visitor) {
+    for (auto param : parameters) visitor(param);
+    visitor(body);
+  }
+
+  inline void If::visit(std::function<void(NodePtr)> visitor) {
+    visitor(condition);
+    visitor(ifBody);
+    if (elseBody) visitor(elseBody);
+  }
+
+  inline void BinaryOperation::visit(std::function<void(NodePtr)> visitor) {
+    visitor(lhs);
+    visitor(rhs);
+  }
+
+  inline void UnaryOperation::visit(std::function<void(NodePtr)> visitor) {
+    visitor(operand);
+  }
+
+  inline void List::visit(std::function<void(NodePtr)> visitor) {
+    for (auto item : items) visitor(item);
+  }
+
+  inline void Pattern::visit(std::function<void(NodePtr)> visitor) {
+    for (auto value : values) visitor(value);
+  }
+
+  inline void Case::visit(std::function<void(NodePtr)> visitor) {
+    visitor(pattern);
+    visitor(body);
+  }
+
+  inline void Match::visit(std::function<void(NodePtr)> visitor) {
+    visitor(value);
+    for (auto kase : cases) visitor(kase);
+  }
+
+  inline void Assignment::visit(std::function<void(NodePtr)> visitor) {
+    visitor(left);
+    visitor(value);
+  }
+
+  inline void Let::visit(std::function<void(NodePtr)> visitor) {
+    for (auto assignment : assignments) visitor(assignment);
+    visitor(block);
+  }
+
+  inline void Constructor::visit(std::function<void(NodePtr)> visitor) {
+    for (auto arg : arguments) visitor(arg);
+  }
+
   EVAL(MAP(DECLARE_CONVERTER, AST_TYPES))
   EVAL(MAP(DECLARE_CTOR, AST_TYPES))
 }
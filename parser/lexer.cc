@@ -3,6 +3,9 @@
 #include "token.h"
 
 #include <cassert>
+#include <cctype>
+#include <cstdarg>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
@@ -155,16 +158,16 @@ start:
       }
 
       default:
-        if (isnumber(c)) {
+        if (isdigit(c)) {
           double number = 0;
           do {
             number *= 10;
             number += c - '0';
-          } while (isnumber(c = nextChar()));
+          } while (isdigit(c = nextChar()));
 
           if (c == '.') {
             double divider = 1;
-            while (isnumber(c = nextChar())) {
+            while (isdigit(c = nextChar())) {
               divider *= 10;
               number += (c - '0') / divider;
             }
@@ -178,7 +181,7 @@ start:
           unsigned length = 0;
           do {
             length++;
-          } while (islower(c = nextChar()) || isnumber(c) || c == '_');
+          } while (islower(c = nextChar()) || isdigit(c) || c == '_');
 
           m_pos--;
 
@@ -190,7 +193,7 @@ start:
           unsigned length = 0;
           do {
             length++;
-          } while (isalpha(c = nextChar()) || isnumber(c) || c == '_');
+          } while (isalpha(c = nextChar()) || isdigit(c) || c == '_');
 
           m_pos--;
 
@@ -0,0 +1,749 @@
+#include "optimizer.h"
+#include "parser.h"
+
+#include <algorithm>
+#include <climits>
+
+namespace Verve {
+
+  static bool intConstant(AST::NodePtr node, int32_t &value) {
+    if (node->type != AST::Type::Number) {
+      return false;
+    }
+    auto number = AST::asNumber(node);
+    if (number->isFloat || number->value != (int32_t)number->value) {
+      return false;
+    }
+    value = (int32_t)number->value;
+    return true;
+  }
+
+  // Same semantics as the `_i32` opcodes, except for the operations that
+  // would trap, which are left for the program to run
+  static bool evaluate(unsigned op, int32_t lhs, int32_t rhs, int32_t &result) {
+    switch (op) {
+      case '+': result = (int32_t)((uint32_t)lhs + (uint32_t)rhs); break;
+      case '-': result = (int32_t)((uint32_t)lhs - (uint32_t)rhs); break;
+      case '*': result = (int32_t)((uint32_t)lhs * (uint32_t)rhs); break;
+      case '/':
+      case '%':
+        if (!rhs || (lhs == INT_MIN && rhs == -1)) {
+          return false;
+        }
+        result = op == '/' ? lhs / rhs : lhs % rhs;
+        break;
+      case '<': result = lhs < rhs; break;
+      case '>': result = lhs > rhs; break;
+      case TUPLE_TOKEN('<', '='): result = lhs <= rhs; break;
+      case TUPLE_TOKEN('>', '='): result = lhs >= rhs; break;
+      case TUPLE_TOKEN('=', '='): result = lhs == rhs; break;
+      case TUPLE_TOKEN('!', '='): result = lhs != rhs; break;
+      case TUPLE_TOKEN('&', '&'): result = lhs && rhs; break;
+      case TUPLE_TOKEN('|', '|'): result = lhs || rhs; break;
+      default: return false;
+    }
+    return true;
+  }
+
+  static AST::NumberPtr createInt(Loc loc, int32_t value) {
+    auto number = AST::createNumber(loc);
+    number->value = value;
+    return number;
+  }
+
+  // blocks without stack slots of their own can be replaced by their only
+  // node, which may then be folded
+  static AST::NodePtr unwrap(AST::BlockPtr block) {
+    if (block->nodes.size() == 1 && !block->stackSlots) {
+      return block->nodes[0];
+    }
+    return block;
+  }
+
+  void Optimizer::optimize() {
+    collectBindings(m_ast);
+    specialize(m_ast);
+    for (auto &specialization : m_specializations) {
+      auto &nodes = m_declarations[namespaced(specialization.first->ns, specialization.first->name)].second->nodes;
+      auto original = std::find(nodes.begin(), nodes.end(), specialization.first);
+      nodes.insert(original + 1, specialization.second);
+    }
+
+    if (!m_level) {
+      return;
+    }
+
+    rewrite(m_ast);
+  }
+
+  void Optimizer::collectBindings(AST::NodePtr node) {
+    switch (node->type) {
+      case AST::Type::Function: {
+        auto fn = AST::asFunction(node);
+        if (fn->name != "_") {
+          m_functionBindings[namespaced(fn->ns, fn->name)]++;
+        }
+        break;
+      }
+      case AST::Type::Block:
+        for (auto child : AST::asBlock(node)->nodes) {
+          if (child->type != AST::Type::Function) {
+            continue;
+          }
+          auto fn = AST::asFunction(child);
+          if (fn->name != "_" && !fn->declaration) {
+            m_declarations[namespaced(fn->ns, fn->name)] = std::make_pair(fn, AST::asBlock(node).get());
+          }
+        }
+        break;
+      case AST::Type::FunctionParameter:
+        m_localBindings.insert(std::static_pointer_cast<AST::FunctionParameter>(node)->name);
+        break;
+      case AST::Type::Assignment: {
+        auto assignment = AST::asAssignment(node);
+        if (assignment->left->type == AST::Type::Identifier) {
+          m_localBindings.insert(AST::asIdentifier(assignment->left)->name);
+        }
+        break;
+      }
+      case AST::Type::Pattern:
+        for (auto value : AST::asPattern(node)->values) {
+          m_localBindings.insert(value->name);
+        }
+        break;
+      default:
+        break;
+    }
+
+    node->visit([this](AST::NodePtr child) {
+      collectBindings(child);
+    });
+  }
+
+  // Resolves the calls to interface functions that the type checker found
+  // no implementation for: they call a copy of the function made for the
+  // type the interface is used with instead.
+  void Optimizer::specialize(AST::NodePtr node) {
+    node->visit([this](AST::NodePtr child) {
+      specialize(child);
+    });
+
+    if (node->type == AST::Type::Call) {
+      auto call = AST::asCall(node);
+      if (call->interface && !call->implementationType.empty()) {
+        resolve(call);
+      }
+    }
+  }
+
+  // Virtual functions are resolved to their implementation for the type, and
+  // the interface's own functions to their specialization
+  void Optimizer::resolve(AST::CallPtr call) {
+    auto callee = AST::asIdentifier(call->callee);
+    auto &functions = call->interface->concreteFunctions;
+    bool isVirtual = std::find(functions.begin(), functions.end(), callee->name) == functions.end();
+    if (!isVirtual && !specialization(callee, call)) {
+      return;
+    }
+
+    callee->name += call->implementationType;
+    call->interface = nullptr;
+    call->implementationType.clear();
+  }
+
+  // Copies the function called by `call` for the type of its interface,
+  // unless it has been copied already. Returns false for functions that
+  // can't be copied.
+  bool Optimizer::specialization(AST::IdentifierPtr callee, AST::CallPtr call) {
+    auto name = callee->name + call->implementationType;
+    if (m_functionBindings.count(namespaced(callee->ns, name))) {
+      return true;
+    }
+
+    auto it = m_declarations.find(namespaced(callee->ns, callee->name));
+    if (it == m_declarations.end() || declaresFunctions(it->second.first->body)) {
+      return false;
+    }
+
+    auto fn = it->second.first;
+    auto copy = AST::createFunction(fn->loc);
+    copy->name = name;
+    copy->ns = fn->ns;
+
+    m_clones.clear();
+    for (auto parameter : fn->parameters) {
+      auto parameterCopy = AST::createFunctionParameter(parameter->loc);
+      parameterCopy->name = parameter->name;
+      parameterCopy->index = parameter->index;
+      m_clones[parameter.get()] = parameterCopy;
+      copy->parameters.push_back(parameterCopy);
+    }
+    copy->body = AST::asBlock(clone(fn->body));
+    m_clones.clear();
+
+    m_functionBindings[namespaced(copy->ns, name)] = 1;
+    m_specializations.push_back(std::make_pair(fn, copy));
+
+    // the calls the copy makes to the interface's functions now have a type,
+    // and may need specializations of their own
+    auto interface = call->interface;
+    auto type = call->implementationType;
+    std::function<void(AST::NodePtr)> resolveCalls = [&](AST::NodePtr node) {
+      node->visit(resolveCalls);
+      if (node->type == AST::Type::Call) {
+        auto inner = AST::asCall(node);
+        if (inner->interface == interface && inner->implementationType.empty()) {
+          inner->implementationType = type;
+          resolve(inner);
+        }
+      }
+    };
+    resolveCalls(copy->body);
+    return true;
+  }
+
+  // Returns the node that replaces `node`, whose children have been
+  // rewritten in place.
+  AST::NodePtr Optimizer::rewrite(AST::NodePtr node) {
+    switch (node->type) {
+      case AST::Type::Program: {
+        auto program = AST::asProgram(node);
+        m_frame = program->body.get();
+        rewriteBlock(program->body);
+        return node;
+      }
+      case AST::Type::Block: {
+        // the body of an imported file, which holds its own stack slots
+        // unless it doesn't need any
+        auto block = AST::asBlock(node);
+        auto frame = m_frame;
+        if (block->stackSlots) {
+          m_frame = block.get();
+        }
+        rewriteBlock(block);
+        m_frame = frame;
+        return node;
+      }
+      case AST::Type::Identifier: {
+        // arguments can only replace references from the function itself,
+        // captured ones are read from the closure
+        auto ident = AST::asIdentifier(node);
+        auto declaration = ident->binding ? ident->binding : ident.get();
+        auto it = m_values.find(declaration);
+        if (it == m_values.end() || (ident->binding && it->second->type != AST::Type::Number)) {
+          return node;
+        }
+        return it->second;
+      }
+      case AST::Type::Call: {
+        auto call = AST::asCall(node);
+        call->callee = rewrite(call->callee);
+        for (auto &arg : call->arguments) {
+          arg = rewrite(arg);
+        }
+        return m_level >= 2 ? inlineCall(call) : node;
+      }
+      case AST::Type::Function: {
+        auto fn = AST::asFunction(node);
+        auto frame = m_frame;
+        m_frame = fn->body.get();
+        rewriteBlock(fn->body);
+        m_frame = frame;
+
+        if (m_level >= 2 && isInlinable(fn)) {
+          m_inlinable[namespaced(fn->ns, fn->name)] = fn;
+        }
+        return node;
+      }
+      case AST::Type::If:
+        return prune(AST::asIf(node));
+      case AST::Type::BinaryOperation: {
+        auto operation = AST::asBinaryOperation(node);
+        operation->lhs = rewrite(operation->lhs);
+        operation->rhs = rewrite(operation->rhs);
+        return fold(operation);
+      }
+      case AST::Type::UnaryOperation: {
+        auto operation = AST::asUnaryOperation(node);
+        operation->operand = rewrite(operation->operand);
+        return fold(operation);
+      }
+      case AST::Type::List:
+        for (auto &item : AST::asList(node)->items) {
+          item = rewrite(item);
+        }
+        return node;
+      case AST::Type::Constructor:
+        for (auto &arg : AST::asConstructor(node)->arguments) {
+          arg = rewrite(arg);
+        }
+        return node;
+      case AST::Type::Match: {
+        auto match = AST::asMatch(node);
+        match->value = rewrite(match->value);
+        for (auto kase : match->cases) {
+          // pattern values may reuse the declaration of a binding they shadow
+          std::vector<std::pair<AST::Node *, AST::NodePtr>> shadowed;
+          for (auto value : kase->pattern->values) {
+            auto it = m_values.find(value.get());
+            if (it != m_values.end()) {
+              shadowed.push_back(*it);
+              m_values.erase(it);
+            }
+          }
+          rewriteBlock(kase->body);
+          m_values.insert(shadowed.begin(), shadowed.end());
+        }
+        return node;
+      }
+      case AST::Type::Let:
+        return rewriteLet(AST::asLet(node));
+      default:
+        return node;
+    }
+  }
+
+  void Optimizer::rewriteBlock(AST::BlockPtr block) {
+    std::vector<AST::NodePtr> nodes;
+    for (auto node : block->nodes) {
+      node = rewrite(node);
+      // blocks left by pruned `if`s and `let`s are flattened into this one
+      if (node->type == AST::Type::Block && !AST::asBlock(node)->stackSlots) {
+        auto &inner = AST::asBlock(node)->nodes;
+        nodes.insert(nodes.end(), inner.begin(), inner.end());
+      } else {
+        nodes.push_back(node);
+      }
+    }
+    block->nodes = std::move(nodes);
+  }
+
+  AST::NodePtr Optimizer::rewriteLet(AST::LetPtr let) {
+    std::vector<std::pair<AST::Node *, AST::NodePtr>> shadowed;
+    auto bind = [&](AST::Node *declaration, AST::NodePtr value) {
+      auto it = m_values.find(declaration);
+      shadowed.push_back(std::make_pair(declaration, it != m_values.end() ? it->second : nullptr));
+      if (value) {
+        m_values[declaration] = value;
+      } else {
+        m_values.erase(declaration);
+      }
+    };
+
+    for (auto assignment : let->assignments) {
+      assignment->value = rewrite(assignment->value);
+      if (assignment->left->type == AST::Type::Identifier) {
+        auto value = assignment->value;
+        bool isCopy = value->type == AST::Type::Number || value->type == AST::Type::FunctionParameter;
+        bind(assignment->left.get(), isCopy ? value : nullptr);
+      } else if (assignment->left->type == AST::Type::Pattern) {
+        for (auto value : AST::asPattern(assignment->left)->values) {
+          bind(value.get(), nullptr);
+        }
+      }
+    }
+
+    rewriteBlock(let->block);
+
+    for (auto it = shadowed.rbegin(); it != shadowed.rend(); it++) {
+      if (it->second) {
+        m_values[it->first] = it->second;
+      } else {
+        m_values.erase(it->first);
+      }
+    }
+
+    // bindings nothing refers to are only kept for their side effects, and
+    // give their stack slot back to the frame
+    for (unsigned i = let->assignments.size(); i-- > 0;) {
+      auto assignment = let->assignments[i];
+      if (assignment->left->type != AST::Type::Identifier || !isPure(assignment->value)) {
+        continue;
+      }
+
+      auto &name = AST::asIdentifier(assignment->left)->name;
+      bool isUsed = mentions(name, let->block);
+      for (unsigned j = i + 1; j < let->assignments.size() && !isUsed; j++) {
+        isUsed = mentions(name, let->assignments[j]);
+      }
+      if (!isUsed) {
+        let->assignments.erase(let->assignments.begin() + i);
+        m_frame->stackSlots--;
+      }
+    }
+
+    if (!let->assignments.size()) {
+      return unwrap(let->block);
+    }
+    return let;
+  }
+
+  AST::NodePtr Optimizer::fold(AST::BinaryOperationPtr operation) {
+    int32_t lhs, rhs, result;
+    if (
+        !operation->isIntOperation ||
+        !intConstant(operation->lhs, lhs) ||
+        !intConstant(operation->rhs, rhs) ||
+        !evaluate(operation->op, lhs, rhs, result)
+       )
+    {
+      return operation;
+    }
+    return createInt(operation->loc, result);
+  }
+
+  AST::NodePtr Optimizer::fold(AST::UnaryOperationPtr operation) {
+    int32_t operand;
+    if (!operation->isIntOperation || !intConstant(operation->operand, operand)) {
+      return operation;
+    }
+    auto result = operation->op == '!' ? !operand : (int32_t)(0u - (uint32_t)operand);
+    return createInt(operation->loc, result);
+  }
+
+  AST::NodePtr Optimizer::prune(AST::IfPtr iff) {
+    iff->condition = rewrite(iff->condition);
+
+    int32_t condition;
+    if (intConstant(iff->condition, condition)) {
+      if (condition) {
+        rewriteBlock(iff->ifBody);
+        return unwrap(iff->ifBody);
+      } else if (iff->elseBody) {
+        rewriteBlock(iff->elseBody);
+        return unwrap(iff->elseBody);
+      }
+      // an `if` without `else` leaves nothing on the stack when skipped
+      return AST::createBlock(iff->loc);
+    }
+
+    rewriteBlock(iff->ifBody);
+    if (iff->elseBody) {
+      rewriteBlock(iff->elseBody);
+    }
+    return iff;
+  }
+
+  // Replaces the call with a `let` binding the arguments to copies of the
+  // parameters, in the order the call would evaluate them, around a copy of
+  // the function's body. Every name the copy declares is renamed, so it
+  // can't shadow the caller's locals.
+  AST::NodePtr Optimizer::inlineCall(AST::CallPtr call) {
+    if (call->callee->type != AST::Type::Identifier) {
+      return call;
+    }
+
+    auto callee = AST::asIdentifier(call->callee);
+    auto it = m_inlinable.find(namespaced(callee->ns, callee->name));
+    if (callee->binding || it == m_inlinable.end()) {
+      return call;
+    }
+
+    auto fn = it->second;
+    if (fn->parameters.size() != call->arguments.size()) {
+      return call;
+    }
+
+    m_inlinedCalls++;
+    m_clones.clear();
+
+    auto let = AST::createLet(call->loc);
+    let->env = fn->body->env;
+    for (unsigned i = call->arguments.size(); i-- > 0;) {
+      auto assignment = AST::createAssignment(call->arguments[i]->loc);
+      assignment->left = cloneDeclaration(fn->parameters[i]);
+      assignment->value = call->arguments[i];
+      let->assignments.push_back(assignment);
+    }
+    let->block = AST::asBlock(clone(fn->body));
+    let->block->stackSlots = 0;
+    m_clones.clear();
+
+    m_frame->stackSlots += fn->parameters.size() + fn->body->stackSlots;
+    return rewriteLet(let);
+  }
+
+  bool Optimizer::isInlinable(AST::FunctionPtr fn) {
+    // functions declared inside others are closures. Implementations of
+    // interfaces are called by the name of their type, like specializations
+    if (fn->name == "_" || fn->declaration) {
+      return false;
+    }
+
+    auto name = namespaced(fn->ns, fn->name);
+    if (m_functionBindings[name] != 1 || m_localBindings.count(name)) {
+      return false;
+    }
+
+    // the values of all but the last expression of a body stay on the stack
+    // until the function returns, which would be the caller once inlined
+    if (fn->body->nodes.size() != 1 || size(fn->body) > InlineLimit || mentions(fn->name, fn->body)) {
+      return false;
+    }
+
+    // globals have to refer to the same value from any caller, so they
+    // can't share a name with a local
+    std::unordered_set<AST::Node *> declarations;
+    bool isInlinable = true;
+    std::function<void(AST::NodePtr)> check = [&](AST::NodePtr node) {
+      switch (node->type) {
+        case AST::Type::Function:
+          isInlinable = false;
+          return;
+        case AST::Type::Assignment: {
+          auto left = AST::asAssignment(node)->left;
+          if (left->type == AST::Type::Identifier) {
+            declarations.insert(left.get());
+          }
+          break;
+        }
+        case AST::Type::Pattern:
+          for (auto value : AST::asPattern(node)->values) {
+            declarations.insert(value.get());
+          }
+          break;
+        case AST::Type::Identifier: {
+          auto ident = AST::asIdentifier(node);
+          if (ident->binding || (!declarations.count(ident.get()) && m_localBindings.count(ident->name))) {
+            isInlinable = false;
+          }
+          break;
+        }
+        default:
+          break;
+      }
+      node->visit(check);
+    };
+    check(fn->body);
+    return isInlinable;
+  }
+
+  // Copies a node of the function being inlined. Shared nodes, like the
+  // references to a local that all point to its declaration, stay shared.
+  AST::NodePtr Optimizer::clone(AST::NodePtr node) {
+    auto it = m_clones.find(node.get());
+    if (it != m_clones.end()) {
+      return it->second;
+    }
+
+    AST::NodePtr copy;
+    switch (node->type) {
+      case AST::Type::Number:
+      case AST::Type::String:
+        return node;
+      case AST::Type::Identifier: {
+        auto ident = AST::asIdentifier(node);
+        auto identCopy = AST::createIdentifier(ident->loc);
+        identCopy->name = ident->name;
+        identCopy->ns = ident->ns;
+        copy = identCopy;
+        break;
+      }
+      case AST::Type::Block: {
+        auto block = AST::asBlock(node);
+        auto blockCopy = AST::createBlock(block->loc);
+        blockCopy->env = block->env;
+        blockCopy->stackSlots = block->stackSlots;
+        for (auto child : block->nodes) {
+          blockCopy->nodes.push_back(clone(child));
+        }
+        copy = blockCopy;
+        break;
+      }
+      case AST::Type::Call: {
+        auto call = AST::asCall(node);
+        auto callCopy = AST::createCall(call->loc);
+        callCopy->callee = clone(call->callee);
+        for (auto arg : call->arguments) {
+          callCopy->arguments.push_back(clone(arg));
+        }
+        callCopy->interface = call->interface;
+        callCopy->implementationType = call->implementationType;
+        copy = callCopy;
+        break;
+      }
+      case AST::Type::If: {
+        auto iff = AST::asIf(node);
+        auto ifCopy = AST::createIf(iff->loc);
+        ifCopy->condition = clone(iff->condition);
+        ifCopy->ifBody = AST::asBlock(clone(iff->ifBody));
+        if (iff->elseBody) {
+          ifCopy->elseBody = AST::asBlock(clone(iff->elseBody));
+        }
+        copy = ifCopy;
+        break;
+      }
+      case AST::Type::BinaryOperation: {
+        auto operation = AST::asBinaryOperation(node);
+        auto operationCopy = AST::createBinaryOperation(operation->loc);
+        operationCopy->op = operation->op;
+        operationCopy->lhs = clone(operation->lhs);
+        operationCopy->rhs = clone(operation->rhs);
+        operationCopy->isIntOperation = operation->isIntOperation;
+        operationCopy->isFloatOperation = operation->isFloatOperation;
+        copy = operationCopy;
+        break;
+      }
+      case AST::Type::UnaryOperation: {
+        auto operation = AST::asUnaryOperation(node);
+        auto operationCopy = AST::createUnaryOperation(operation->loc);
+        operationCopy->op = operation->op;
+        operationCopy->operand = clone(operation->operand);
+        operationCopy->isIntOperation = operation->isIntOperation;
+        operationCopy->isFloatOperation = operation->isFloatOperation;
+        copy = operationCopy;
+        break;
+      }
+      case AST::Type::List: {
+        auto list = AST::asList(node);
+        auto listCopy = AST::createList(list->loc);
+        for (auto item : list->items) {
+          listCopy->items.push_back(clone(item));
+        }
+        copy = listCopy;
+        break;
+      }
+      case AST::Type::Constructor: {
+        auto ctor = AST::asConstructor(node);
+        auto ctorCopy = AST::createConstructor(ctor->loc);
+        ctorCopy->name = ctor->name;
+        ctorCopy->tag = ctor->tag;
+        ctorCopy->size = ctor->size;
+        for (auto arg : ctor->arguments) {
+          ctorCopy->arguments.push_back(clone(arg));
+        }
+        copy = ctorCopy;
+        break;
+      }
+      case AST::Type::Pattern: {
+        auto pattern = AST::asPattern(node);
+        auto patternCopy = AST::createPattern(pattern->loc);
+        patternCopy->tag = pattern->tag;
+        patternCopy->constructorName = pattern->constructorName;
+        for (auto value : pattern->values) {
+          patternCopy->values.push_back(cloneDeclaration(value));
+        }
+        copy = patternCopy;
+        break;
+      }
+      case AST::Type::Match: {
+        auto match = AST::asMatch(node);
+        auto matchCopy = AST::createMatch(match->loc);
+        matchCopy->value = clone(match->value);
+        for (auto kase : match->cases) {
+          auto caseCopy = AST::createCase(kase->loc);
+          caseCopy->pattern = AST::asPattern(clone(kase->pattern));
+          caseCopy->body = AST::asBlock(clone(kase->body));
+          matchCopy->cases.push_back(caseCopy);
+        }
+        copy = matchCopy;
+        break;
+      }
+      case AST::Type::Let: {
+        auto let = AST::asLet(node);
+        auto letCopy = AST::createLet(let->loc);
+        letCopy->env = let->env;
+        for (auto assignment : let->assignments) {
+          auto assignmentCopy = AST::createAssignment(assignment->loc);
+          if (assignment->left->type == AST::Type::Identifier) {
+            assignmentCopy->left = cloneDeclaration(AST::asIdentifier(assignment->left));
+          } else {
+            assignmentCopy->left = clone(assignment->left);
+          }
+          assignmentCopy->value = clone(assignment->value);
+          letCopy->assignments.push_back(assignmentCopy);
+        }
+        letCopy->block = AST::asBlock(clone(let->block));
+        copy = letCopy;
+        break;
+      }
+      default:
+        throw std::runtime_error("Trying to inline a function with unsupported nodes");
+    }
+
+    m_clones[node.get()] = copy;
+    return copy;
+  }
+
+  AST::IdentifierPtr Optimizer::cloneDeclaration(AST::IdentifierPtr declaration) {
+    auto it = m_clones.find(declaration.get());
+    if (it != m_clones.end()) {
+      return std::static_pointer_cast<AST::Identifier>(it->second);
+    }
+
+    auto copy = AST::createIdentifier(declaration->loc);
+    copy->name = declaration->name + "$" + std::to_string(m_inlinedCalls);
+    m_clones[declaration.get()] = copy;
+    return copy;
+  }
+
+  // Whether evaluating the node can be skipped when its value isn't used
+  bool Optimizer::isPure(AST::NodePtr node) {
+    switch (node->type) {
+      case AST::Type::Number:
+      case AST::Type::String:
+      case AST::Type::Identifier:
+      case AST::Type::FunctionParameter:
+        return true;
+      case AST::Type::Function:
+        return AST::asFunction(node)->name == "_";
+      case AST::Type::BinaryOperation: {
+        auto operation = AST::asBinaryOperation(node);
+        int32_t rhs;
+        // float divisions never trap
+        if (!operation->isFloatOperation && (operation->op == '/' || operation->op == '%') && !(intConstant(operation->rhs, rhs) && rhs && rhs != -1)) {
+          return false;
+        }
+        return (operation->isIntOperation || operation->isFloatOperation) &&
+          isPure(operation->lhs) && isPure(operation->rhs);
+      }
+      case AST::Type::UnaryOperation: {
+        auto operation = AST::asUnaryOperation(node);
+        return (operation->isIntOperation || operation->isFloatOperation) && isPure(operation->operand);
+      }
+      case AST::Type::List:
+      case AST::Type::Constructor: {
+        bool isPure = true;
+        node->visit([&](AST::NodePtr child) {
+          isPure = isPure && Optimizer::isPure(child);
+        });
+        return isPure;
+      }
+      default:
+        return false;
+    }
+  }
+
+  bool Optimizer::declaresFunctions(AST::NodePtr node) {
+    if (node->type == AST::Type::Function) {
+      return true;
+    }
+
+    bool found = false;
+    node->visit([&](AST::NodePtr child) {
+      found = found || declaresFunctions(child);
+    });
+    return found;
+  }
+
+  bool Optimizer::mentions(const std::string &name, AST::NodePtr node) {
+    if (node->type == AST::Type::Identifier || node->type == AST::Type::FunctionParameter) {
+      return std::static_pointer_cast<AST::Identifier>(node)->name == name;
+    }
+
+    bool found = false;
+    node->visit([&](AST::NodePtr child) {
+      found = found || mentions(name, child);
+    });
+    return found;
+  }
+
+  unsigned Optimizer::size(AST::NodePtr node) {
+    unsigned size = 1;
+    node->visit([&](AST::NodePtr child) {
+      size += Optimizer::size(child);
+    });
+    return size;
+  }
+
+}
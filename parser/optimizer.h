@@ -0,0 +1,77 @@
+#include "ast.h"
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#pragma once
+
+namespace Verve {
+
+  // Rewrites the AST between the parser and the generator. At every level,
+  // the functions of an interface are copied for each type they're called
+  // with, so the calls they make to the interface's other functions go
+  // straight to the implementations for that type. Every level runs the
+  // passes of the previous ones:
+  //   -O1: propagates `let`s of constants and arguments, folds int
+  //        operations over constants, prunes `if`s with constant conditions
+  //        and drops unused `let` bindings without side effects
+  //   -O2: inlines calls to functions whose body is a single small
+  //        expression, and that neither capture values nor call themselves
+  class Optimizer {
+    public:
+      Optimizer(AST::ProgramPtr ast, unsigned level) :
+        m_ast(ast),
+        m_level(level) {}
+
+      void optimize();
+
+      static const unsigned DefaultLevel = 2;
+      // largest function body inlined, in AST nodes
+      static const unsigned InlineLimit = 16;
+
+    private:
+      void collectBindings(AST::NodePtr node);
+      void specialize(AST::NodePtr node);
+      void resolve(AST::CallPtr call);
+      bool specialization(AST::IdentifierPtr callee, AST::CallPtr call);
+      AST::NodePtr rewrite(AST::NodePtr node);
+      void rewriteBlock(AST::BlockPtr block);
+      AST::NodePtr rewriteLet(AST::LetPtr let);
+      AST::NodePtr fold(AST::BinaryOperationPtr operation);
+      AST::NodePtr fold(AST::UnaryOperationPtr operation);
+      AST::NodePtr prune(AST::IfPtr iff);
+      AST::NodePtr inlineCall(AST::CallPtr call);
+      bool isInlinable(AST::FunctionPtr fn);
+      AST::NodePtr clone(AST::NodePtr node);
+      AST::IdentifierPtr cloneDeclaration(AST::IdentifierPtr declaration);
+
+      static bool isPure(AST::NodePtr node);
+      static bool declaresFunctions(AST::NodePtr node);
+      static bool mentions(const std::string &name, AST::NodePtr node);
+      static unsigned size(AST::NodePtr node);
+
+      AST::ProgramPtr m_ast;
+      unsigned m_level;
+      // function name => number of `fn` declarations binding it
+      std::unordered_map<std::string, unsigned> m_functionBindings;
+      // function name => top-level function, and the block that declares it
+      std::unordered_map<std::string, std::pair<AST::FunctionPtr, AST::Block *>> m_declarations;
+      // functions specialized for a type, added after the functions they copy
+      // once the whole AST has been visited
+      std::vector<std::pair<AST::FunctionPtr, AST::FunctionPtr>> m_specializations;
+      // names bound by parameters, `let`s and patterns, which may shadow globals
+      std::unordered_set<std::string> m_localBindings;
+      // function name => function whose calls can be replaced by its body
+      std::unordered_map<std::string, AST::FunctionPtr> m_inlinable;
+      // `let` declarations in scope that are bound to a constant or to an
+      // argument, which replace the references to them
+      std::unordered_map<AST::Node *, AST::NodePtr> m_values;
+      // body of the function being rewritten, which holds its stack slots
+      AST::Block *m_frame = nullptr;
+      // copies of the nodes of the function being inlined or specialized
+      std::unordered_map<AST::Node *, AST::NodePtr> m_clones;
+      unsigned m_inlinedCalls = 0;
+  };
+
+}
@@ -6,6 +6,8 @@
 
 #include "utils/file.h"
 
+#include <algorithm>
+
 std::string ROOT_DIR = "";
 
 namespace Verve {
@@ -399,9 +401,6 @@ namespace Verve {
     parseBody(fn->body);
     m_blockStack.pop_back();
 
-    fn->needsScope = m_scope->isRequired;
-    fn->capturesScope = m_scope->capturesScope;
-
     popScope();
 
     return fn;
@@ -418,6 +417,15 @@ namespace Verve {
 
     auto env = m_environment;
 
+    // Functions declared inside other functions are bound like `let`s, so
+    // that closures can capture them
+    if (fn->name != "_" && isInsideFunction()) {
+      fn->declaration = AST::createIdentifier(start);
+      fn->declaration->name = fn->name;
+      m_scope->set(fn->name, fn->declaration);
+      m_blockStack.back()->stackSlots++;
+    }
+
     pushScope();
 
     parseGenerics(fnType->generics);
@@ -434,14 +442,20 @@ namespace Verve {
     parseBody(fn->body);
     m_blockStack.pop_back();
 
-    fn->needsScope = m_scope->isRequired;
-    fn->capturesScope = m_scope->capturesScope;
-
     popScope();
 
     return fn;
   }
 
+  bool Parser::isInsideFunction() {
+    for (auto s = m_scope; s->parent() != nullptr; s = s->parent()) {
+      if (s->escapes) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   AST::IfPtr Parser::parseIf() {
     auto iff = AST::createIf(token().loc);
 
@@ -492,12 +506,6 @@ namespace Verve {
 
     parseBody(let->block);
 
-    if (m_scope->isRequired) {
-      m_scope->parent()->isRequired = true;
-    }
-    if (m_scope->capturesScope) {
-      m_scope->parent()->capturesScope = true;
-    }
     popScope();
 
     return let;
@@ -506,6 +514,8 @@ namespace Verve {
   AST::MatchPtr Parser::parseMatch() {
     auto match = AST::createMatch(token().loc);
     match->value = parseExpr();
+    // the scrutinee is evaluated once and kept in a stack slot
+    m_blockStack.back()->stackSlots++;
 
     this->match('{');
     while (!skip('}')) {
@@ -617,7 +627,7 @@ namespace Verve {
       auto name = token(Token::LCID).string();
       generics.push_back(name);
 
-      setType(name, new GenericType(std::move(name)));
+      setType(name, new GenericType(name));
     } while (skip(','));
 
     return match('>');
@@ -690,25 +700,22 @@ namespace Verve {
       ParseScopePtr scope;
       if ((scope = m_scope->scopeFor(name)) != m_scope) {
         bool shouldCapture = false;
-        auto s = m_scope;
-        while (s != scope) {
+        for (auto s = m_scope; s != scope; s = s->parent()) {
           if (s->escapes) {
             shouldCapture = true;
             break;
           }
-          s = s->parent();
         }
 
         if (shouldCapture) {
-          ident->isCaptured = true;
-          scope->isRequired = true;
-          m_scope->capturesScope = true;
-          goto ident;
+          auto identifier = AST::createIdentifier(loc);
+          identifier->name = name;
+          identifier->binding = ident;
+          return identifier;
         }
       }
     }
     if (var) return var;
-ident:
 
     auto identifier = AST::createIdentifier(loc);
     identifier->name = name;
@@ -81,6 +81,7 @@ namespace Verve {
 
     void pushScope();
     void popScope();
+    bool isInsideFunction();
 
     // Lexer aliases
 
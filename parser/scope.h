@@ -60,8 +60,6 @@ namespace Verve {
         return m_parent;
       }
 
-      bool isRequired;
-      bool capturesScope;
       bool escapes = true;
     private:
       ParseScopePtr m_parent;
@@ -1,5 +1,6 @@
 #include "type_checker.h"
 
+#include <algorithm>
 #include <cstdarg>
 #include <cstdio>
 
@@ -106,6 +107,19 @@ static Type *typeCheckArguments(std::vector<AST::NodePtr> &arguments, TypeFuncti
   return simplifyType(fnType->returnType, env);
 }
 
+// Operators can be redefined, in which case they must go through a regular call
+static bool isBuiltinOperator(std::string name, EnvPtr env) {
+  auto fnType = dynamic_cast<TypeFunction *>(env->get(name));
+  return fnType && fnType->isExternal;
+}
+
+static bool isInterfaceFunction(const std::string &name, TypeInterface *interface) {
+  auto &virtuals = interface->virtualFunctions;
+  auto &concretes = interface->concreteFunctions;
+  return std::find(virtuals.begin(), virtuals.end(), name) != virtuals.end() ||
+    std::find(concretes.begin(), concretes.end(), name) != concretes.end();
+}
+
 Type *TypeChecker::typeof(AST::NodePtr node, EnvPtr env, Lexer &lexer) {
   try {
     auto type = node->typeof(env);
@@ -124,13 +138,51 @@ Type *AST::String::typeof(EnvPtr env) {
   return env->get("string");
 }
 
+// the operators that have a `_f64` opcode
+static bool isFloatOperator(unsigned op) {
+  switch (op) {
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '<':
+    case '>':
+    case TUPLE_TOKEN('<', '='):
+    case TUPLE_TOKEN('>', '='):
+    case TUPLE_TOKEN('=', '='):
+    case TUPLE_TOKEN('!', '='):
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool isComparison(unsigned op) {
+  return op != '+' && op != '-' && op != '*' && op != '/';
+}
+
 Type *AST::BinaryOperation::typeof(EnvPtr env) {
   auto intType = env->get("int");
+  auto floatType = env->get("float");
   AST::NodePtr failed = nullptr;
   Verve::Type *failedType = nullptr;
-  if (!intType->accepts((failedType = lhs->typeof(env)), env)) {
+  // the type of an interface's implementation is known inside it
+  auto lhsType = simplifyType(lhs->typeof(env), env);
+
+  // floats are never mixed with ints, and the operators can't be redefined
+  // for them
+  if (isFloatOperator(op) && floatType->accepts(lhsType, env)) {
+    auto rhsType = simplifyType(rhs->typeof(env), env);
+    if (!floatType->accepts(rhsType, env)) {
+      throw TypeError(rhs->loc, "Binary operations on `float` only accept `float`, but found `%s`", rhsType->toString().c_str());
+    }
+    isFloatOperation = true;
+    return isComparison(op) ? intType : floatType;
+  }
+
+  if (!intType->accepts((failedType = lhsType), env)) {
     failed = lhs;
-  } else if (!intType->accepts((failedType = rhs->typeof(env)), env)) {
+  } else if (!intType->accepts((failedType = simplifyType(rhs->typeof(env), env)), env)) {
     failed = rhs;
   }
 
@@ -138,11 +190,24 @@ Type *AST::BinaryOperation::typeof(EnvPtr env) {
     throw TypeError(failed->loc, "Binary operations only accept `int`, but found `%s`", failedType->toString().c_str());
   }
 
+  isIntOperation = isBuiltinOperator(std::string(reinterpret_cast<char *>(&op)), env);
+
   return env->get("int");
 }
 
 Type *AST::UnaryOperation::typeof(EnvPtr env) {
-  return env->get("int");
+  auto intType = env->get("int");
+  auto floatType = env->get("float");
+  auto operandType = simplifyType(operand->typeof(env), env);
+  if (op == '-' && floatType->accepts(operandType, env)) {
+    isFloatOperation = true;
+    return floatType;
+  }
+
+  isIntOperation = intType->accepts(operandType, env) &&
+    isBuiltinOperator("unary_" + std::string(reinterpret_cast<char *>(&op)), env);
+
+  return intType;
 }
 
 Type *AST::Number::typeof(EnvPtr env) {
@@ -199,10 +264,18 @@ Type *AST::Call::typeof(EnvPtr env) {
   auto returnType = typeCheckArguments(arguments, fnType, env, loc);
 
   if (fnType->interface) {
+    auto interface = fnType->interface;
     auto ident = AST::asIdentifier(callee);
-    auto name = ident->name + env->types[fnType->interface->genericTypeName]->toString();
+    auto type = env->types[interface->genericTypeName];
+    auto name = ident->name + type->toString();
     if (env->get(name)) {
       ident->name = name;
+    } else if (isInterfaceFunction(ident->name, interface)) {
+      // resolved by specializing the function, see `Optimizer::specialize`
+      this->interface = interface;
+      if (type != interface && !dynamic_cast<GenericType *>(type)) {
+        implementationType = type->toString();
+      }
     }
   }
 
@@ -210,6 +283,8 @@ Type *AST::Call::typeof(EnvPtr env) {
 }
 
 Type *AST::If::typeof(EnvPtr env) {
+  condition->typeof(env);
+
   auto iffType = ifBody->typeof(env);
   if (elseBody) {
     auto elseType = elseBody->typeof(env);
@@ -257,6 +332,8 @@ Type *AST::Match::typeof(EnvPtr env) {
     throw TypeError(loc, "Cannot have `match` expression with no cases");
   }
 
+  value->typeof(env);
+
   ::Verve::Type *t = nullptr;
   for (auto kase : cases) {
     auto type = simplifyType(kase->typeof(env), env);
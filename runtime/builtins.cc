@@ -2,6 +2,8 @@
 #include "vm.h"
 
 #include <cassert>
+#include <climits>
+#include <cmath>
 
 extern "C" void *builtin_sub();
 extern "C" void *builtin_add();
@@ -9,37 +11,60 @@ extern "C" void *builtin_lt();
 
 namespace Verve {
 
+#define BUILTINS(X) \
+    X(print, print) \
+ \
+    X(+, builtin_add) \
+    X(-, builtin_sub) \
+    X(*, mul) \
+    X(/, div) \
+    X(%, mod) \
+    X(<, builtin_lt) \
+    X(>, gt) \
+    X(<=, lte) \
+    X(>=, gte) \
+    X(==, equals) \
+    X(!=, not_equal) \
+    X(&&, _and) \
+    X(||, _or) \
+ \
+    X(unary_!, _not) \
+    X(unary_-, minus) \
+ \
+    X(to_float, toFloat) \
+    X(to_int, toInt) \
+    X(sqrt, _sqrt) \
+    X(floor, _floor) \
+ \
+    X(at, at) \
+    X(substr, substr) \
+    X(count, count) \
+    X(__heap-size__, heapSize)
+
+#define BUILTIN_ENTRY(NAME, FN) { #NAME, (Builtin)FN },
+
+  static const struct {
+    const char *name;
+    Builtin fn;
+  } builtins[] = {
+    BUILTINS(BUILTIN_ENTRY)
+  };
+
+#undef BUILTIN_ENTRY
+
   void registerBuiltins(VM &vm) {
+    for (auto &builtin : builtins) {
+      vm.m_scope->set(builtin.name, Value(builtin.fn));
+    }
+  }
 
-#define REGISTER(NAME, FN) \
-    do { \
-      Builtin FN##_ = (Builtin)FN;  \
-      vm.m_scope->set(#NAME, Value(FN##_)); \
-    } while(0)
-
-    REGISTER(print, print);
-
-    REGISTER(+, builtin_add);
-    REGISTER(-, builtin_sub);
-    REGISTER(*, mul);
-    REGISTER(/, div);
-    REGISTER(%, mod);
-    REGISTER(<, builtin_lt);
-    REGISTER(>, gt);
-    REGISTER(<=, lte);
-    REGISTER(>=, gte);
-    REGISTER(==, equals);
-    REGISTER(!=, not_equal);
-    REGISTER(&&, _and);
-    REGISTER(||, _or);
-
-    REGISTER(unary_!, _not);
-    REGISTER(unary_-, minus);
-
-    REGISTER(at, at);
-    REGISTER(substr, substr);
-    REGISTER(count, count);
-    REGISTER(__heap-size__, heapSize);
+  const char *builtinName(Builtin fn) {
+    for (auto &builtin : builtins) {
+      if (builtin.fn == fn) {
+        return builtin.name;
+      }
+    }
+    return NULL;
   }
 
 
@@ -78,6 +103,32 @@ namespace Verve {
   }
 
 
+  VERVE_FUNCTION(toFloat) {
+    assert(argc == 1);
+    return Value((double)argv[0].asInt());
+  }
+
+  // truncates towards zero. Doubles out of the range of ints, and NaNs, give
+  // INT_MIN, as the conversion of the hardware does
+  VERVE_FUNCTION(toInt) {
+    assert(argc == 1);
+    auto d = argv[0].asDouble();
+    if (!(d > (double)INT_MIN - 1 && d < (double)INT_MAX + 1)) {
+      return Value(INT_MIN);
+    }
+    return Value((int)d);
+  }
+
+  VERVE_FUNCTION(_sqrt) {
+    assert(argc == 1);
+    return Value(std::sqrt(argv[0].asDouble()));
+  }
+
+  VERVE_FUNCTION(_floor) {
+    assert(argc == 1);
+    return Value(std::floor(argv[0].asDouble()));
+  }
+
   static void printValue(Value value) {
     if (value.isString()) {
       printf("%s", value.asString().str());
@@ -88,10 +139,10 @@ namespace Verve {
       }
     } else if (value.isInt()){
       printf("%d", value.asInt());
+    } else if (value.isDouble()) {
+      printf("%lg", value.asDouble());
     } else {
-      auto v = value.encode();
-      printf("%lg", *(double *)&v);
-      //throw std::runtime_error("Trying to print unsupported type");
+      throw std::runtime_error("Trying to print unsupported type");
     }
   }
 
@@ -150,7 +201,7 @@ namespace Verve {
 
     Value arg = argv[0];
     if (arg.isString()) {
-      return strlen(arg.asString());
+      return (int)strlen(arg.asString());
     } else {
       throw;
     }
@@ -26,6 +26,10 @@ namespace Verve {
   VERVE_FUNCTION(_or);
   VERVE_FUNCTION(_not);
   VERVE_FUNCTION(minus);
+  VERVE_FUNCTION(toFloat);
+  VERVE_FUNCTION(toInt);
+  VERVE_FUNCTION(_sqrt);
+  VERVE_FUNCTION(_floor);
   VERVE_FUNCTION(at);
   VERVE_FUNCTION(substr);
   VERVE_FUNCTION(count);
@@ -33,4 +37,7 @@ namespace Verve {
 
   void registerBuiltins(VM &);
 
+  // the name a builtin is registered with, used to save it in a snapshot
+  const char *builtinName(Value (*)(unsigned, Value *, VM *));
+
 }
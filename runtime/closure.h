@@ -1,18 +1,30 @@
 #include "function.h"
-#include "scope.h"
 #include "value.h"
 
 #pragma once
 
 namespace Verve {
 
+  // Closures hold copies of the values they capture, which follow the
+  // header. Functions that don't capture anything use fast closures instead.
   struct Closure {
-    Scope *scope;
     Function *fn;
+    unsigned offset; // same as fn->offset, read from asm
+    unsigned size;
 
-    Closure() : scope(NULL) {}
-    Closure(Scope *s) : scope(s->inc()) {}
-    ~Closure() { if (scope) scope->dec(); }
+    Value at(unsigned index) {
+      assert(index < size);
+      return ((Value *)this)[index + 2];
+    }
+
+    // where the code of a closure, fast or not, starts
+    static inline uint32_t entryOffset(uint64_t callee) {
+      auto target = Value::unmask(callee);
+      if (target & 1) {
+        return (uint32_t)target >> 1;
+      }
+      return ((Closure *)target)->offset;
+    }
   };
 
 }
@@ -9,9 +9,10 @@ namespace Verve {
   class VM;
 
   struct Function {
-    Function(unsigned i, unsigned args, unsigned o, std::vector<String> &&a) :
+    Function(unsigned i, unsigned args, unsigned o, unsigned l, std::vector<String> &&a) :
       id(i),
       offset(o),
+      length(l),
       nargs(args),
       args(a) {}
 
@@ -19,6 +20,8 @@ namespace Verve {
 
     unsigned id;
     unsigned offset;
+    // size of the code, in bytes
+    unsigned length;
     unsigned nargs;
     std::vector<String> args;
   };
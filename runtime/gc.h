@@ -55,9 +55,8 @@ namespace Verve {
               markValue(value.asObject()->at(i), heap);
             }
           } else if (value.isClosure()) {
-            Scope *scope;
-            if ((scope = value.asClosure()->scope) != NULL) {
-              markScope(scope, heap);
+            for (unsigned i = 0; i < value.asClosure()->size; i++) {
+              markValue(value.asClosure()->at(i), heap);
             }
           }
         }
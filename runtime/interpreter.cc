@@ -0,0 +1,520 @@
+#include "interpreter.h"
+
+#include "vm.h"
+
+#include "bytecode/compact.h"
+
+#include <sys/mman.h>
+
+namespace Verve {
+
+extern "C" uint64_t createClosure(VM *vm, unsigned fnID, unsigned size, Value *captures);
+extern "C" void setScope(VM *vm, const char *name, Value value);
+extern "C" void symbolNotFound(char *);
+extern "C" void tagTestFailed(unsigned, unsigned);
+extern "C" uintptr_t allocate(VM *vm, unsigned size);
+extern "C" void fillCallCache(VM *vm, uint64_t *cache, uint64_t callee, const uint8_t *bcbase);
+
+#define LABEL_ADDRESS(__op, _) &&label_##__op,
+
+// The same handlers run both encodings of the code, see `WideCode` and
+// `CompactCode` below
+#define READ(__n) ((uint64_t)Code::operand(pc, __n))
+#define PUSH(__v) (*--sp = (uint64_t)(__v))
+#define POP() (*sp++)
+#define DISPATCH() goto *dispatch[Code::opcode(pc)]
+#define SKIP(__n) pc = Code::skip(pc, __n); DISPATCH()
+#define JUMP(__offset) pc = (Pointer)((const uint8_t *)pc + (int64_t)(__offset)); DISPATCH()
+
+// Values that may hold the only reference to a heap object must be visible
+// to the GC before calling anything that allocates.
+#define SYNC_STACK() vm->m_sp = sp
+
+#define GET_ARG(__i) (fp[4 + (__i)])
+
+// lhs is on top of the stack, rhs right below it. Ints are 32 bits wide and
+// zero extended, as returned by the builtins.
+#define BINARY_I32(__expr) { \
+    int32_t lhs = (int32_t)POP(); \
+    int32_t rhs = (int32_t)*sp; \
+    *sp = (uint32_t)(__expr); \
+  }
+
+// the register tier reads lhs from the frame, and rhs either from the frame
+// (`rr`) or from the bytecode (`rk`)
+#define REGISTER_I32(__rhs, __expr) { \
+    int32_t lhs = (int32_t)fp[(int64_t)READ(1)]; \
+    int32_t rhs = (int32_t)(__rhs); \
+    PUSH((uint32_t)(__expr)); \
+  }
+
+#define UNARY_I32(__expr) { \
+    int32_t operand = (int32_t)*sp; \
+    *sp = (uint32_t)(__expr); \
+  }
+
+// doubles are NaN-boxed, see value.h
+#define BINARY_F64(__expr) { \
+    double lhs = Value::decode(POP()).asDouble(); \
+    double rhs = Value::decode(*sp).asDouble(); \
+    *sp = Value(__expr).encode(); \
+  }
+
+#define COMPARE_F64(__expr) { \
+    double lhs = Value::decode(POP()).asDouble(); \
+    double rhs = Value::decode(*sp).asDouble(); \
+    *sp = (uint32_t)(__expr); \
+  }
+
+#define EXPR_add ((uint32_t)lhs + (uint32_t)rhs)
+#define EXPR_sub ((uint32_t)lhs - (uint32_t)rhs)
+#define EXPR_mul ((uint32_t)lhs * (uint32_t)rhs)
+#define EXPR_div (lhs / rhs)
+#define EXPR_mod (lhs % rhs)
+#define EXPR_lt (lhs < rhs)
+#define EXPR_gt (lhs > rhs)
+#define EXPR_lte (lhs <= rhs)
+#define EXPR_gte (lhs >= rhs)
+#define EXPR_eq (lhs == rhs)
+#define EXPR_ne (lhs != rhs)
+#define EXPR_and (lhs && rhs)
+#define EXPR_or (lhs || rhs)
+
+// Straight-line opcodes are defined by a body, shared with the
+// superinstructions that start with them.
+#define BODY_push() PUSH(READ(1))
+#define BODY_load_string() PUSH(Value(stringTable[READ(1)]).encode())
+#define BODY_push_arg() PUSH(GET_ARG(READ(1)))
+#define BODY_closure_load() PUSH(Value::decode(fp[1]).asClosure()->at(READ(1)).encode())
+#define BODY_push_callee() PUSH(fp[1])
+#define BODY_obj_load() { \
+    auto object = (uint64_t *)Value::unmask(POP()); \
+    PUSH(object[1 + (int64_t)READ(1)]); \
+  }
+#define BODY_stack_store() slots[READ(1)] = POP()
+#define BODY_stack_load() PUSH(slots[READ(1)])
+#define BODY_add_i32() BINARY_I32(EXPR_add)
+#define BODY_sub_i32() BINARY_I32(EXPR_sub)
+#define BODY_mul_i32() BINARY_I32(EXPR_mul)
+#define BODY_div_i32() BINARY_I32(EXPR_div)
+#define BODY_mod_i32() BINARY_I32(EXPR_mod)
+#define BODY_lt_i32() BINARY_I32(EXPR_lt)
+#define BODY_gt_i32() BINARY_I32(EXPR_gt)
+#define BODY_lte_i32() BINARY_I32(EXPR_lte)
+#define BODY_gte_i32() BINARY_I32(EXPR_gte)
+#define BODY_eq_i32() BINARY_I32(EXPR_eq)
+#define BODY_ne_i32() BINARY_I32(EXPR_ne)
+#define BODY_and_i32() BINARY_I32(EXPR_and)
+#define BODY_or_i32() BINARY_I32(EXPR_or)
+#define BODY_add_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_add)
+#define BODY_sub_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_sub)
+#define BODY_mul_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_mul)
+#define BODY_div_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_div)
+#define BODY_mod_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_mod)
+#define BODY_lt_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_lt)
+#define BODY_gt_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_gt)
+#define BODY_lte_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_lte)
+#define BODY_gte_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_gte)
+#define BODY_eq_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_eq)
+#define BODY_ne_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_ne)
+#define BODY_and_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_and)
+#define BODY_or_i32_rr() REGISTER_I32(fp[(int64_t)READ(2)], EXPR_or)
+#define BODY_add_i32_rk() REGISTER_I32(READ(2), EXPR_add)
+#define BODY_sub_i32_rk() REGISTER_I32(READ(2), EXPR_sub)
+#define BODY_mul_i32_rk() REGISTER_I32(READ(2), EXPR_mul)
+#define BODY_div_i32_rk() REGISTER_I32(READ(2), EXPR_div)
+#define BODY_mod_i32_rk() REGISTER_I32(READ(2), EXPR_mod)
+#define BODY_lt_i32_rk() REGISTER_I32(READ(2), EXPR_lt)
+#define BODY_gt_i32_rk() REGISTER_I32(READ(2), EXPR_gt)
+#define BODY_lte_i32_rk() REGISTER_I32(READ(2), EXPR_lte)
+#define BODY_gte_i32_rk() REGISTER_I32(READ(2), EXPR_gte)
+#define BODY_eq_i32_rk() REGISTER_I32(READ(2), EXPR_eq)
+#define BODY_ne_i32_rk() REGISTER_I32(READ(2), EXPR_ne)
+#define BODY_and_i32_rk() REGISTER_I32(READ(2), EXPR_and)
+#define BODY_or_i32_rk() REGISTER_I32(READ(2), EXPR_or)
+#define BODY_not_i32() UNARY_I32(!operand)
+#define BODY_neg_i32() UNARY_I32(-(uint32_t)operand)
+#define BODY_add_f64() BINARY_F64(lhs + rhs)
+#define BODY_sub_f64() BINARY_F64(lhs - rhs)
+#define BODY_mul_f64() BINARY_F64(lhs * rhs)
+#define BODY_div_f64() BINARY_F64(lhs / rhs)
+#define BODY_lt_f64() COMPARE_F64(lhs < rhs)
+#define BODY_gt_f64() COMPARE_F64(lhs > rhs)
+#define BODY_lte_f64() COMPARE_F64(lhs <= rhs)
+#define BODY_gte_f64() COMPARE_F64(lhs >= rhs)
+#define BODY_eq_f64() COMPARE_F64(lhs == rhs)
+#define BODY_ne_f64() COMPARE_F64(lhs != rhs)
+#define BODY_neg_f64() (*sp = Value(-Value::decode(*sp).asDouble()).encode())
+
+#define STRAIGHT_LINE_HANDLER(__op, __operands) \
+  label_##__op: \
+    BODY_##__op(); \
+    SKIP(__operands);
+
+// A superinstruction runs the bodies of its leading components and jumps
+// straight to the handler of the last one, skipping their dispatches.
+#define SUPERINSTRUCTION_2(__name, __a, __aOperands, __b) \
+  label_##__name: \
+    BODY_##__a(); \
+    pc = Code::skip(pc, __aOperands); \
+    goto label_##__b;
+
+#define SUPERINSTRUCTION_3(__name, __a, __aOperands, __b, __bOperands, __c) \
+  label_##__name: \
+    BODY_##__a(); \
+    pc = Code::skip(pc, __aOperands); \
+    BODY_##__b(); \
+    pc = Code::skip(pc, __bOperands); \
+    goto label_##__c;
+
+// A word per opcode and per operand
+struct WideCode {
+  typedef const uint64_t *Pointer;
+
+  ALWAYS_INLINE static uint64_t opcode(Pointer pc) {
+    return *pc;
+  }
+
+  ALWAYS_INLINE static uint64_t operand(Pointer pc, unsigned n) {
+    return pc[n];
+  }
+
+  // the instruction after an opcode followed by `n` operands
+  ALWAYS_INLINE static Pointer skip(Pointer pc, unsigned n) {
+    return pc + n + 1;
+  }
+};
+
+// A byte per opcode, and LEB128 operands, see bytecode/compact.h. Operands
+// are decoded from the start of the instruction every time they're read.
+struct CompactCode {
+  typedef const uint8_t *Pointer;
+
+  ALWAYS_INLINE static uint64_t opcode(Pointer pc) {
+    return *pc;
+  }
+
+  ALWAYS_INLINE static int64_t operand(Pointer pc, unsigned n) {
+    pc++;
+    while (--n) {
+      CompactEncoding::skipOperand(pc);
+    }
+    return CompactEncoding::readOperand(pc);
+  }
+
+  ALWAYS_INLINE static Pointer skip(Pointer pc, unsigned n) {
+    pc++;
+    while (n--) {
+      CompactEncoding::skipOperand(pc);
+    }
+    return pc;
+  }
+};
+
+void CxxInterpreter::execute(
+    const uint8_t *bytecode,
+    String *stringTable,
+    VM *vm,
+    const uint8_t *bcbase,
+    void *lookupTable)
+{
+  if (vm->m_encoding == Section::Compact) {
+    run<CompactCode>(bytecode, stringTable, vm, bcbase, lookupTable);
+  } else {
+    run<WideCode>(bytecode, stringTable, vm, bcbase, lookupTable);
+  }
+}
+
+template<typename Code>
+void CxxInterpreter::run(
+    const uint8_t *bytecode,
+    String *stringTable,
+    VM *vm,
+    const uint8_t *bcbase,
+    void *lookupTable)
+{
+  typedef typename Code::Pointer Pointer;
+
+  static const void *const labels[] = {
+    EVAL(MAP_2(LABEL_ADDRESS, OPCODES))
+  };
+  static const size_t opcodeCount = sizeof(labels) / sizeof(*labels);
+
+  // when profiling, every opcode goes through `label_profile` first
+  const void *profiled[opcodeCount];
+  auto dispatch = labels;
+  if (vm->m_profile) {
+    for (size_t i = 0; i < opcodeCount; i++) {
+      profiled[i] = &&label_profile;
+    }
+    dispatch = profiled;
+  }
+
+  size_t stackBytes = StackSize * WORD_SIZE;
+  size_t guard = 1 << 12;
+  auto stack = (uint8_t *)mmap(NULL, stackBytes + guard, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  assert(stack != MAP_FAILED);
+  // overflowing the stack faults, as it would on the native stack
+  mprotect(stack, guard, PROT_NONE);
+
+  auto stackEnd = (uint64_t *)(stack + stackBytes + guard);
+  auto lookup = (uint64_t *)lookupTable;
+  auto pc = (Pointer)bytecode;
+  uint64_t *sp = stackEnd;
+  uint64_t *fp = sp;
+  uint64_t *slots = NULL;
+
+  // operands of the tail call being performed
+  uint64_t tailCallee;
+  uint64_t tailArgc;
+
+  vm->m_sp = sp;
+  vm->m_stackEnd = stackEnd;
+
+  DISPATCH();
+
+label_profile: {
+  auto opcode = (Opcode::Type)Code::opcode(pc);
+  vm->m_profile->record(opcode);
+  goto *labels[(int)opcode];
+}
+
+label_exit:
+  vm->m_sp = NULL;
+  vm->m_stackEnd = NULL;
+  munmap(stack, stackBytes + guard);
+  return;
+
+label_ret: {
+  auto result = POP();
+  sp = fp;
+  fp = (uint64_t *)POP();
+  sp++; // callee
+  auto argc = POP();
+  pc = (Pointer)POP();
+  sp += argc;
+  PUSH(result);
+  SKIP(2);
+}
+
+label_bind: {
+  auto value = Value::decode(POP());
+  SYNC_STACK();
+  setScope(vm, stringTable[READ(1)].str(), value);
+  SKIP(1);
+}
+
+label_call: {
+  auto encoded = POP();
+  auto argc = READ(1);
+
+  auto cache = vm->m_callCaches + 2 * READ(2);
+
+  // inline cache hit, see `op_call`
+  if (encoded == cache[0]) {
+    vm->m_callCacheHits++;
+    PUSH(pc);
+    PUSH(argc);
+    PUSH(encoded);
+    PUSH(fp);
+    fp = sp;
+    pc = (Pointer)cache[1];
+    DISPATCH();
+  }
+
+  auto callee = Value::decode(encoded);
+  if (!callee.isClosure()) {
+    SYNC_STACK();
+    auto result = callee.asBuiltin()(argc, (Value *)sp, vm);
+    sp += argc;
+    PUSH(result.encode());
+    SKIP(2);
+  }
+
+  // the callee is kept tagged, so the GC can see the closure while it runs.
+  // The return address is the call, which `ret` skips along with its
+  // operands: both `call` and `call_direct` have two.
+  vm->m_callCacheMisses++;
+  PUSH(pc);
+  PUSH(argc);
+  PUSH(encoded);
+  PUSH(fp);
+  fp = sp;
+
+  if (cache[0] != CALL_CACHE_MEGAMORPHIC) {
+    fillCallCache(vm, cache, encoded, bcbase);
+  }
+  pc = (Pointer)(bcbase + Closure::entryOffset(encoded));
+  DISPATCH();
+}
+
+label_call_direct: {
+  auto offset = vm->functionOffset(READ(1));
+  auto argc = READ(2);
+  // same frame as a fast closure
+  PUSH(pc);
+  PUSH(argc);
+  PUSH(Value::fastClosure(offset).encode());
+  PUSH(fp);
+  fp = sp;
+  pc = (Pointer)(bcbase + offset);
+  DISPATCH();
+}
+
+label_tail_call: {
+  auto callee = Value::decode(POP());
+  auto argc = READ(1);
+
+  // builtins don't need a frame: call it and return its result right away
+  if (!callee.isClosure()) {
+    SYNC_STACK();
+    auto result = callee.asBuiltin()(argc, (Value *)sp, vm);
+    PUSH(result.encode());
+    goto label_ret;
+  }
+
+  tailCallee = callee.encode();
+  tailArgc = argc;
+  goto tail_call;
+}
+
+label_tail_call_direct:
+  tailCallee = Value::fastClosure(vm->functionOffset(READ(1))).encode();
+  tailArgc = READ(2);
+
+tail_call: {
+  auto callerFp = fp[0];
+  auto returnPc = fp[3];
+  auto args = fp + 4 + fp[2];
+
+  // the new arguments always live below the current ones, so copying from
+  // the last one down is safe even if they overlap
+  for (auto i = tailArgc; i > 0;) {
+    i--;
+    *--args = sp[i];
+  }
+
+  sp = args;
+  PUSH(returnPc);
+  PUSH(tailArgc);
+  PUSH(tailCallee);
+  PUSH(callerFp);
+  fp = sp;
+
+  pc = (Pointer)(bcbase + Closure::entryOffset(tailCallee));
+  DISPATCH();
+}
+
+label_jz:
+  if (POP() == 0) {
+    JUMP(READ(1));
+  }
+  SKIP(1);
+
+label_jmp:
+  JUMP(READ(1));
+
+// jump table indexed by the object's tag, with offsets relative to the
+// opcode. Tags past the end of the table fall through.
+label_switch_tag: {
+  auto object = (Object *)Value::unmask(POP());
+  auto size = READ(1);
+  if (object->tag < size) {
+    JUMP(READ(2 + object->tag));
+  }
+  SKIP(1 + size);
+}
+
+label_create_closure: {
+  // the captured values stay on the stack for the GC
+  SYNC_STACK();
+  auto closure = createClosure(vm, READ(1), READ(2), (Value *)sp);
+  sp += READ(2);
+  PUSH(closure);
+  SKIP(2);
+}
+
+label_lookup: {
+  auto cacheSlot = READ(2);
+  auto cached = lookup[cacheSlot];
+  if (cached) {
+    PUSH(cached);
+    SKIP(2);
+  }
+
+  auto name = stringTable[READ(1)];
+  auto value = vm->m_scope->get(name);
+  if (value.isUndefined()) {
+    symbolNotFound((char *)name.str());
+  }
+  if (cacheSlot) {
+    lookup[cacheSlot] = value.encode();
+  }
+  PUSH(value.encode());
+  SKIP(2);
+}
+
+label_alloc_obj: {
+  SYNC_STACK();
+  auto object = (Object *)allocate(vm, READ(1));
+  object->tag = READ(2);
+  object->size = READ(1) - 1;
+  PUSH(Value(object).encode());
+  SKIP(2);
+}
+
+label_alloc_list: {
+  SYNC_STACK();
+  auto list = (List *)allocate(vm, READ(1));
+  list->length = READ(1) - 1;
+  PUSH(Value(list).encode());
+  SKIP(1);
+}
+
+label_obj_store_at: {
+  auto value = POP();
+  auto object = (uint64_t *)Value::unmask(*sp);
+  object[READ(1)] = value;
+  SKIP(1);
+}
+
+label_obj_tag_test: {
+  auto object = (Object *)Value::unmask(POP());
+  if (object->tag != READ(1)) {
+    tagTestFailed(object->tag, READ(1));
+  }
+  SKIP(1);
+}
+
+label_stack_alloc:
+  PUSH(slots);
+  sp -= READ(1) / WORD_SIZE;
+  slots = sp;
+  SKIP(1);
+
+label_stack_free: {
+  auto result = POP();
+  sp = slots + READ(1) / WORD_SIZE;
+  slots = (uint64_t *)POP();
+  PUSH(result);
+  SKIP(1);
+}
+
+// only the assembly engine compiles functions
+label_jit_count:
+label_jit_resume:
+  SKIP(1);
+
+// restores the slots pointer saved by a `stack_alloc` of the given size,
+// leaving the stack itself to `tail_call`
+label_stack_unwind:
+  slots = (uint64_t *)slots[READ(1) / WORD_SIZE];
+  SKIP(1);
+
+EVAL(MAP_2(STRAIGHT_LINE_HANDLER, STRAIGHT_LINE_OPCODES))
+
+SUPERINSTRUCTIONS_2(SUPERINSTRUCTION_2)
+SUPERINSTRUCTIONS_3(SUPERINSTRUCTION_3)
+}
+
+}
@@ -0,0 +1,42 @@
+#include "bytecode/opcodes.h"
+#include "utils/macros.h"
+
+#include <cstddef>
+#include <cstdint>
+
+#pragma once
+
+namespace Verve {
+  class VM;
+  class String;
+
+  ENUM_CLASS(Engine,
+    Asm,
+    Cxx,
+  );
+
+  // Portable counterpart of interpreter.S, built on labels-as-values.
+  // It runs the same bytecode, or its compact encoding, dispatching through its own table of labels,
+  // and keeps its operand stack in a separate buffer that the GC scans.
+  class CxxInterpreter {
+    public:
+      static void execute(
+          const uint8_t *bytecode,
+          String *stringTable,
+          VM *vm,
+          const uint8_t *bcbase,
+          void *lookupTable);
+
+      static const size_t StackSize = 1 << 20; // in words
+
+    private:
+      template<typename Code>
+      static void run(
+          const uint8_t *bytecode,
+          String *stringTable,
+          VM *vm,
+          const uint8_t *bcbase,
+          void *lookupTable);
+  };
+
+}
@@ -0,0 +1,482 @@
+#include "jit.h"
+
+#include "vm.h"
+
+#include <cassert>
+#include <cstring>
+#include <sys/mman.h>
+#include <unordered_set>
+
+namespace Verve {
+
+extern "C" uintptr_t jitCount(VM *vm, unsigned fnID, const uint8_t *bcbase);
+uintptr_t jitCount(VM *vm, unsigned fnID, const uint8_t *bcbase) {
+  // bytecode compiled with `--jit` may run without it
+  if (!vm->m_jit) {
+    return 0;
+  }
+  return vm->m_jit->countCall(fnID, bcbase);
+}
+
+// largest template, in bytes per word of bytecode: a fallback for an
+// instruction with 2 operands, or a `call_direct`
+static const unsigned s_maxTemplateSize = 80;
+
+#define I32_OPERATIONS(X) \
+  X(add) X(sub) X(mul) X(div) X(mod) \
+  X(lt) X(gt) X(lte) X(gte) X(eq) X(ne) \
+  X(and) X(or)
+
+enum class Operands { Stack, Registers, Constant };
+
+// the stack form of an int operation and where its operands come from
+static bool i32Operation(Opcode::Type opcode, Opcode::Type &operation, Operands &operands) {
+#define I32_OPERATION_CASES(__name) \
+  case Opcode::__name##_i32: \
+    operation = Opcode::__name##_i32; operands = Operands::Stack; return true; \
+  case Opcode::__name##_i32_rr: \
+    operation = Opcode::__name##_i32; operands = Operands::Registers; return true; \
+  case Opcode::__name##_i32_rk: \
+    operation = Opcode::__name##_i32; operands = Operands::Constant; return true;
+
+  switch (opcode) {
+    I32_OPERATIONS(I32_OPERATION_CASES)
+    default:
+      return false;
+  }
+#undef I32_OPERATION_CASES
+}
+
+// second byte of the `setcc` of a comparison, or 0. The matching `jcc rel32`
+// is 0x10 lower, and flipping the lowest bit negates the condition.
+static uint8_t setcc(Opcode::Type operation) {
+  switch (operation) {
+    case Opcode::lt_i32: return 0x9C;
+    case Opcode::gt_i32: return 0x9F;
+    case Opcode::lte_i32: return 0x9E;
+    case Opcode::gte_i32: return 0x9D;
+    case Opcode::eq_i32: return 0x94;
+    case Opcode::ne_i32: return 0x95;
+    default: return 0;
+  }
+}
+
+Jit::Jit(VM *vm, unsigned threshold) :
+  m_vm(vm),
+  m_threshold(threshold),
+  m_code(NULL),
+  m_cursor(NULL),
+  m_end(NULL) {}
+
+Jit::~Jit() {
+  if (m_code) {
+    munmap(m_code, CodeSize);
+  }
+}
+
+uintptr_t Jit::countCall(unsigned fnID, const uint8_t *bcbase) {
+  if (m_calls.size() <= fnID) {
+    m_calls.resize(m_vm->m_userFunctions.size());
+  }
+  if (++m_calls[fnID] != m_threshold) {
+    return 0;
+  }
+  return compile(fnID, bcbase);
+}
+
+uintptr_t Jit::compile(unsigned fnID, const uint8_t *bcbase) {
+  if (!m_code) {
+    auto code = mmap(NULL, CodeSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+      return 0;
+    }
+    m_code = m_cursor = (uint8_t *)code;
+    m_end = m_code + CodeSize;
+  }
+
+  auto &fn = m_vm->function(fnID);
+  auto entry = (const uint64_t *)(bcbase + fn.offset);
+  auto end = (const uint64_t *)(bcbase + fn.offset + fn.length);
+
+  std::vector<const uint64_t *> instructions;
+  std::unordered_set<const uint64_t *> targets;
+  auto ip = entry;
+  while (ip < end) {
+    auto opcode = Opcode::firstComponent((Opcode::Type)*ip);
+    instructions.push_back(ip);
+    switch (opcode) {
+      case Opcode::jz:
+      case Opcode::jmp:
+        targets.insert(ip + (int64_t)ip[1] / WORD_SIZE);
+        break;
+      case Opcode::switch_tag:
+        for (unsigned i = 0; i < ip[1]; i++) {
+          targets.insert(ip + (int64_t)ip[2 + i] / WORD_SIZE);
+        }
+        ip += ip[1];
+        break;
+      default:
+        break;
+    }
+    ip += Opcode::size(opcode) + 1;
+  }
+
+  if ((size_t)(m_end - m_cursor) < (size_t)(ip - entry) * s_maxTemplateSize) {
+    return 0;
+  }
+
+  align();
+  auto start = m_cursor;
+  for (unsigned i = 0; i < instructions.size(); i++) {
+    auto instruction = instructions[i];
+    auto opcode = Opcode::firstComponent((Opcode::Type)*instruction);
+    m_native[instruction] = m_cursor;
+
+    switch (opcode) {
+      case Opcode::jit_count:
+        break;
+
+      case Opcode::push: {
+        auto value = instruction[1];
+        if (value < 0x80000000) {
+          emit({ 0x68 }); // push imm32
+          emit32(value);
+        } else {
+          emit({ 0x48, 0xB8 }); // movabs rax, imm64
+          emit64(value);
+          emit({ 0x50 }); // push rax
+        }
+        break;
+      }
+
+      case Opcode::push_arg:
+        emit({ 0xFF, 0xB5 }); // push [rbp + disp32]
+        emit32(0x20 + instruction[1] * WORD_SIZE);
+        break;
+
+      case Opcode::push_callee:
+        emit({ 0xFF, 0x75, 0x08 }); // push [rbp + 8]
+        break;
+
+      case Opcode::closure_load:
+        emit({
+          0x48, 0x8B, 0x45, 0x08, // mov rax, [rbp + 8]
+          0x48, 0xC1, 0xE0, 0x10, // shl rax, 16
+          0x48, 0xC1, 0xE8, 0x10, // shr rax, 16
+          0xFF, 0xB0, // push [rax + disp32]
+        });
+        emit32(0x10 + instruction[1] * WORD_SIZE);
+        break;
+
+      case Opcode::obj_load:
+        emit({
+          0x5F, // pop rdi
+          0x48, 0xC1, 0xE7, 0x10, // shl rdi, 16
+          0x48, 0xC1, 0xEF, 0x10, // shr rdi, 16
+          0xFF, 0xB7, // push [rdi + disp32]
+        });
+        emit32(0x8 + instruction[1] * WORD_SIZE);
+        break;
+
+      case Opcode::stack_load:
+        emit({ 0x41, 0xFF, 0xB5 }); // push [r13 + disp32]
+        emit32(instruction[1] * WORD_SIZE);
+        break;
+
+      case Opcode::stack_store:
+        emit({ 0x41, 0x8F, 0x85 }); // pop [r13 + disp32]
+        emit32(instruction[1] * WORD_SIZE);
+        break;
+
+      case Opcode::not_i32:
+        emit({
+          0x58, // pop rax
+          0x85, 0xC0, // test eax, eax
+          0x0F, 0x94, 0xC0, // sete al
+          0x0F, 0xB6, 0xC0, // movzx eax, al
+          0x50, // push rax
+        });
+        break;
+
+      case Opcode::neg_i32:
+        emit({
+          0x58, // pop rax
+          0xF7, 0xD8, // neg eax
+          0x50, // push rax
+        });
+        break;
+
+      case Opcode::jz:
+        emit({
+          0x58, // pop rax
+          0x48, 0x85, 0xC0, // test rax, rax
+          0x0F, 0x84, // jz rel32
+        });
+        emitJumpTo(instruction + (int64_t)instruction[1] / WORD_SIZE);
+        break;
+
+      case Opcode::jmp:
+        emit({ 0xE9 }); // jmp rel32
+        emitJumpTo(instruction + (int64_t)instruction[1] / WORD_SIZE);
+        break;
+
+      case Opcode::switch_tag:
+        emitSwitchTag(instruction);
+        break;
+
+      case Opcode::call_direct:
+        emitCallDirect(instruction, bcbase);
+        break;
+
+      case Opcode::ret:
+        emitRet();
+        break;
+
+      default: {
+        const uint64_t *jz = NULL;
+        if (i + 1 < instructions.size() && !targets.count(instructions[i + 1]) &&
+            Opcode::firstComponent((Opcode::Type)*instructions[i + 1]) == Opcode::jz) {
+          jz = instructions[i + 1];
+        }
+        if (!emitIntOperation(opcode, instruction, jz)) {
+          emitFallback(instruction, opcode);
+        } else if (jz) {
+          i++;
+        }
+      }
+    }
+  }
+
+  for (auto &jump : m_jumps) {
+    auto target = m_native.at(jump.second);
+    int32_t rel = target - (jump.first + 4);
+    memcpy(jump.first, &rel, sizeof(rel));
+  }
+  for (auto &slot : m_tables) {
+    auto target = (uint64_t)m_native.at(slot.second);
+    memcpy(slot.first, &target, sizeof(target));
+  }
+  m_native.clear();
+  m_jumps.clear();
+  m_tables.clear();
+
+  m_vm->m_jitEntries[fnID] = (uint64_t)start;
+  return (uintptr_t)start;
+}
+
+void Jit::emit(std::initializer_list<uint8_t> bytes) {
+  for (auto byte : bytes) {
+    *m_cursor++ = byte;
+  }
+}
+
+void Jit::emit32(uint32_t value) {
+  memcpy(m_cursor, &value, sizeof(value));
+  m_cursor += sizeof(value);
+}
+
+void Jit::emit64(uint64_t value) {
+  memcpy(m_cursor, &value, sizeof(value));
+  m_cursor += sizeof(value);
+}
+
+void Jit::align() {
+  while ((uintptr_t)m_cursor % WORD_SIZE) {
+    emit({ 0xCC }); // int3, never executed
+  }
+}
+
+void Jit::emitJumpTo(const uint64_t *target) {
+  m_jumps.push_back(std::make_pair(m_cursor, target));
+  emit32(0);
+}
+
+void Jit::emitDispatch() {
+  emit({
+    0x49, 0x8B, 0x04, 0x24, // mov rax, [r12]
+    0x49, 0xBB, // movabs r11, dispatch_table
+  });
+  emit64((uint64_t)dispatch_table);
+  emit({ 0x41, 0xFF, 0x24, 0xC3 }); // jmp [r11 + rax * 8]
+}
+
+void Jit::emitResume() {
+  emit64(Opcode::jit_resume);
+  emit64((uint64_t)m_cursor + WORD_SIZE);
+}
+
+// Points BYTECODE to a copy of the instruction and runs its handler, which
+// ends by dispatching to the `jit_resume` that follows the copy, or by
+// pushing the address of the copy as a return address for `ret`, which
+// skips the operands in the same way.
+void Jit::emitFallback(const uint64_t *instruction, Opcode::Type opcode) {
+  auto size = Opcode::size(opcode);
+
+  emit({ 0x49, 0xBC }); // movabs r12, record
+  auto record = m_cursor;
+  emit64(0);
+  emitDispatch();
+
+  align();
+  auto address = (uint64_t)m_cursor;
+  memcpy(record, &address, sizeof(address));
+  emit64(opcode);
+  for (unsigned i = 1; i <= size; i++) {
+    emit64(instruction[i]);
+  }
+  emitResume();
+}
+
+// Same frame as `op_call_direct`. The return address is chosen so that the
+// `SKIP 1` at the end of `ret` lands on a `jit_resume`.
+void Jit::emitCallDirect(const uint64_t *instruction, const uint8_t *bcbase) {
+  auto offset = m_vm->functionOffset(instruction[1]);
+  auto argc = instruction[2];
+
+  emit({ 0x48, 0xB8 }); // movabs rax, return address
+  auto returnAddress = m_cursor;
+  emit64(0);
+  emit({ 0x50 }); // push rax
+  emit({ 0x68 }); // push argc
+  emit32(argc);
+  emit({ 0x48, 0xB8 }); // movabs rax, callee
+  emit64(Value::fastClosure(offset).encode());
+  emit({
+    0x50, // push rax
+    0x55, // push rbp
+    0x48, 0x89, 0xE5, // mov rbp, rsp
+    0x49, 0xBC, // movabs r12, entry
+  });
+  emit64((uint64_t)(bcbase + offset));
+  emitDispatch();
+
+  align();
+  auto address = (uint64_t)m_cursor - 2 * WORD_SIZE;
+  memcpy(returnAddress, &address, sizeof(address));
+  emitResume();
+}
+
+void Jit::emitRet() {
+  emit({
+    0x58, // pop rax
+    0x48, 0x89, 0xEC, // mov rsp, rbp
+    0x5D, // pop rbp
+    0x5E, // pop rsi (callee)
+    0x5F, // pop rdi (argc)
+    0x41, 0x5C, // pop r12
+    0x48, 0x8D, 0x24, 0xFC, // lea rsp, [rsp + rdi * 8]
+    0x50, // push rax
+    0x49, 0x83, 0xC4, 0x10, // add r12, 0x10
+  });
+  emitDispatch();
+}
+
+// The jump table holds the native addresses of the cases, filled in with
+// the jumps.
+void Jit::emitSwitchTag(const uint64_t *instruction) {
+  auto size = instruction[1];
+
+  emit({
+    0x5F, // pop rdi
+    0x48, 0xC1, 0xE7, 0x10, // shl rdi, 16
+    0x48, 0xC1, 0xEF, 0x10, // shr rdi, 16
+    0x8B, 0x3F, // mov edi, [rdi]
+    0x81, 0xFF, // cmp edi, imm32
+  });
+  emit32(size);
+  emit({ 0x0F, 0x83 }); // jae rel32
+  emitJumpTo(instruction + 2 + size);
+  emit({ 0x48, 0xB8 }); // movabs rax, table
+  auto table = m_cursor;
+  emit64(0);
+  emit({ 0xFF, 0x24, 0xF8 }); // jmp [rax + rdi * 8]
+
+  align();
+  auto address = (uint64_t)m_cursor;
+  memcpy(table, &address, sizeof(address));
+  for (unsigned i = 0; i < size; i++) {
+    m_tables.push_back(std::make_pair(m_cursor, instruction + (int64_t)instruction[2 + i] / WORD_SIZE));
+    emit64(0);
+  }
+}
+
+// Loads lhs into eax and rhs into edi, like OPERANDS_I32 in interpreter.S,
+// and pushes the result. A comparison followed by a `jz` that isn't a jump
+// target branches on the flags instead; `jz` is cleared if it isn't used.
+bool Jit::emitIntOperation(Opcode::Type opcode, const uint64_t *instruction, const uint64_t *&jz) {
+  Opcode::Type operation;
+  Operands operands;
+  if (!i32Operation(opcode, operation, operands)) {
+    return false;
+  }
+
+  switch (operands) {
+    case Operands::Stack:
+      emit({ 0x58, 0x5F }); // pop rax; pop rdi
+      break;
+    case Operands::Registers:
+      emit({ 0x8B, 0x85 }); // mov eax, [rbp + disp32]
+      emit32(instruction[1] * WORD_SIZE);
+      emit({ 0x8B, 0xBD }); // mov edi, [rbp + disp32]
+      emit32(instruction[2] * WORD_SIZE);
+      break;
+    case Operands::Constant:
+      emit({ 0x8B, 0x85 }); // mov eax, [rbp + disp32]
+      emit32(instruction[1] * WORD_SIZE);
+      emit({ 0xBF }); // mov edi, imm32
+      emit32(instruction[2]);
+      break;
+  }
+
+  if (auto condition = setcc(operation)) {
+    emit({ 0x39, 0xF8 }); // cmp eax, edi
+    if (jz) {
+      emit({ 0x0F, (uint8_t)((condition - 0x10) ^ 1) }); // jcc rel32, negated
+      emitJumpTo(jz + (int64_t)jz[1] / WORD_SIZE);
+      return true;
+    }
+    emit({
+      0x0F, condition, 0xC0, // setcc al
+      0x0F, 0xB6, 0xC0, // movzx eax, al
+      0x50, // push rax
+    });
+    return true;
+  }
+
+  jz = NULL;
+
+  switch (operation) {
+    case Opcode::add_i32:
+      emit({ 0x01, 0xF8 }); // add eax, edi
+      break;
+    case Opcode::sub_i32:
+      emit({ 0x29, 0xF8 }); // sub eax, edi
+      break;
+    case Opcode::mul_i32:
+      emit({ 0x0F, 0xAF, 0xC7 }); // imul eax, edi
+      break;
+    case Opcode::div_i32:
+      emit({ 0x99, 0xF7, 0xFF, 0x89, 0xC0 }); // cdq; idiv edi; mov eax, eax
+      break;
+    case Opcode::mod_i32:
+      emit({ 0x99, 0xF7, 0xFF, 0x89, 0xD0 }); // cdq; idiv edi; mov eax, edx
+      break;
+    case Opcode::and_i32:
+    case Opcode::or_i32:
+      emit({
+        0x85, 0xC0, // test eax, eax
+        0x0F, 0x95, 0xC0, // setnz al
+        0x85, 0xFF, // test edi, edi
+        0x0F, 0x95, 0xC2, // setnz dl
+        (uint8_t)(operation == Opcode::and_i32 ? 0x20 : 0x08), 0xD0, // and/or al, dl
+        0x0F, 0xB6, 0xC0, // movzx eax, al
+      });
+      break;
+    default:
+      assert(false);
+  }
+  emit({ 0x50 }); // push rax
+  return true;
+}
+
+}
@@ -0,0 +1,71 @@
+#include "bytecode/opcodes.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <unordered_map>
+#include <vector>
+
+#pragma once
+
+namespace Verve {
+  class VM;
+
+  // Baseline compiler for the assembly engine. Functions start with a
+  // `jit_count` instruction; once a function has been called `threshold`
+  // times its bytecode is translated to x86-64, one template per
+  // instruction, and the native code is stored in VM::m_jitEntries, where
+  // `jit_count` finds it and jumps straight into it on later calls.
+  //
+  // Native code shares the interpreter's frames, stack and registers, so
+  // opcodes without a template still run through their handlers.
+  class Jit {
+    public:
+      Jit(VM *vm, unsigned threshold);
+      ~Jit();
+
+      // returns the native code of the function once it has been compiled
+      uintptr_t countCall(unsigned fnID, const uint8_t *bcbase);
+
+      static const unsigned DefaultThreshold = 100;
+      static const size_t CodeSize = 64 << 20;
+
+    private:
+      uintptr_t compile(unsigned fnID, const uint8_t *bcbase);
+
+      void emit(std::initializer_list<uint8_t>);
+      void emit32(uint32_t);
+      void emit64(uint64_t);
+      void align();
+      // rel32 to the native code of the bytecode instruction at `target`,
+      // filled in once the whole function has been emitted
+      void emitJumpTo(const uint64_t *target);
+      // jumps to the handler of the opcode BYTECODE points to, like DISPATCH
+      // in interpreter.S
+      void emitDispatch();
+      // `jit_resume` followed by the address of the code emitted next
+      void emitResume();
+
+      void emitFallback(const uint64_t *instruction, Opcode::Type opcode);
+      void emitCallDirect(const uint64_t *instruction, const uint8_t *bcbase);
+      void emitRet();
+      void emitSwitchTag(const uint64_t *instruction);
+      // `jz` is the next instruction if it can branch on the flags, and is
+      // cleared unless it was compiled too
+      bool emitIntOperation(Opcode::Type opcode, const uint64_t *instruction, const uint64_t *&jz);
+
+      VM *m_vm;
+      unsigned m_threshold;
+      std::vector<unsigned> m_calls;
+
+      uint8_t *m_code;
+      uint8_t *m_cursor;
+      uint8_t *m_end;
+
+      // state of the function being compiled
+      std::unordered_map<const uint64_t *, uint8_t *> m_native;
+      std::vector<std::pair<uint8_t *, const uint64_t *>> m_jumps;
+      std::vector<std::pair<uint8_t *, const uint64_t *>> m_tables;
+  };
+
+}
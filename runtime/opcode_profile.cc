@@ -0,0 +1,79 @@
+#include "opcode_profile.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+namespace Verve {
+
+#define OPCODE_NAME(__op, _) #__op,
+
+static const char *s_names[] = {
+  EVAL(MAP_2(OPCODE_NAME, OPCODES))
+};
+
+static const unsigned s_count = sizeof(s_names) / sizeof(*s_names);
+
+OpcodeProfile::OpcodeProfile() :
+  m_pairs(s_count * s_count),
+  m_triples(s_count * s_count * s_count) {}
+
+void OpcodeProfile::record(Opcode::Type opcode) {
+  if (m_executed >= 1) {
+    m_pairs[m_previous[1] * s_count + opcode]++;
+  }
+  if (m_executed >= 2) {
+    m_triples[(m_previous[0] * s_count + m_previous[1]) * s_count + opcode]++;
+  }
+  m_previous[0] = m_previous[1];
+  m_previous[1] = opcode;
+  m_executed++;
+}
+
+void OpcodeProfile::save(const char *path) {
+  auto counts = load(path);
+  for (unsigned a = 0; a < s_count; a++) {
+    for (unsigned b = 0; b < s_count; b++) {
+      if (auto count = m_pairs[a * s_count + b]) {
+        counts[{ s_names[a], s_names[b] }] += count;
+      }
+      for (unsigned c = 0; c < s_count; c++) {
+        if (auto count = m_triples[(a * s_count + b) * s_count + c]) {
+          counts[{ s_names[a], s_names[b], s_names[c] }] += count;
+        }
+      }
+    }
+  }
+
+  std::ofstream output(path);
+  for (auto &entry : counts) {
+    output << entry.second;
+    for (auto &name : entry.first) {
+      output << " " << name;
+    }
+    output << "\n";
+  }
+}
+
+// One sequence per line: its count followed by the names of its opcodes
+std::map<OpcodeProfile::Sequence, uint64_t> OpcodeProfile::load(const char *path) {
+  std::map<Sequence, uint64_t> counts;
+  std::ifstream input(path);
+  std::string line;
+  while (std::getline(input, line)) {
+    std::istringstream fields(line);
+    uint64_t count;
+    if (!(fields >> count)) {
+      continue;
+    }
+    Sequence sequence;
+    std::string name;
+    while (fields >> name) {
+      sequence.push_back(name);
+    }
+    counts[sequence] += count;
+  }
+  return counts;
+}
+
+}
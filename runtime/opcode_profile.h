@@ -0,0 +1,38 @@
+#include "bytecode/opcodes.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#pragma once
+
+namespace Verve {
+
+  // Counts the opcode pairs and triples executed by the C++ engine. Every
+  // opcode is dispatched to a single profiling handler, which records it
+  // and then jumps to the actual handler.
+  class OpcodeProfile {
+    public:
+      typedef std::vector<std::string> Sequence;
+
+      OpcodeProfile();
+
+      // called by the profiling handler before running `opcode`
+      void record(Opcode::Type opcode);
+
+      // adds the counts to the ones already saved at `path`, so a profile can
+      // be collected over several programs
+      void save(const char *path);
+
+      static std::map<Sequence, uint64_t> load(const char *path);
+
+      uint64_t executed() const { return m_executed; }
+
+    private:
+      std::vector<uint64_t> m_pairs;
+      std::vector<uint64_t> m_triples;
+      Opcode::Type m_previous[2];
+      uint64_t m_executed = 0;
+  };
+
+}
@@ -45,6 +45,8 @@ namespace Verve {
       table = (Entry *)calloc(tableSize, sizeof(Entry));
 
       if (oldTable) {
+        // `set` counts the entries again as they are reinserted
+        length = 0;
         for (unsigned i = 0; i < oldSize; i++) {
           set(oldTable[i].key, oldTable[i].value);
         }
@@ -144,6 +146,14 @@ namespace Verve {
       }
     }
 
+    void visitEntries(std::function<void(String, Value)> visitor) {
+      for (unsigned i = 0; i < tableSize; i++) {
+        if (table[i].key != 0) {
+          visitor(table[i].key, table[i].value);
+        }
+      }
+    }
+
     struct Entry {
       String key;
       Value value;
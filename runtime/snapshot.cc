@@ -0,0 +1,303 @@
+#include "snapshot.h"
+
+#include "vm.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace Verve {
+
+  static void writeWord(std::ostream &output, uint64_t word) {
+    output.write(reinterpret_cast<char *>(&word), sizeof(word));
+  }
+
+  static size_t padded(size_t size) {
+    return (size + 7) & ~(size_t)7;
+  }
+
+  static uint64_t tagged(uint16_t tag, uint64_t payload) {
+    return (uint64_t)tag << 48 | payload;
+  }
+
+  static bool isFastClosure(Value value) {
+    return value.isClosure() && (Value::unmask(value.encode()) & 1);
+  }
+
+  // Collects the strings and objects reachable from the values it encodes
+  class SnapshotWriter {
+    public:
+      SnapshotWriter(VM &vm) {
+        for (auto &block : vm.blocks) {
+          m_blockSizes[block.second] = block.first;
+        }
+        for (unsigned i = 0; i < vm.m_userFunctions.size(); i++) {
+          if (vm.m_userFunctions[i]) {
+            m_functionIDs[vm.m_userFunctions[i]] = i;
+          }
+        }
+      }
+
+      bool encode(Value value, uint64_t &word) {
+        if (value.isString()) {
+          word = tagged(Value::StringTag, string(value.asString().str()));
+        } else if (value.isBuiltin()) {
+          auto name = builtinName(value.asBuiltin());
+          if (!name) {
+            return false;
+          }
+          word = tagged(Value::BuiltinTag, string(name));
+        } else if (value.isList() || value.isObject() || (value.isClosure() && !isFastClosure(value))) {
+          auto ptr = value.asPtr();
+          auto it = m_objectIDs.find(ptr);
+          if (it == m_objectIDs.end()) {
+            if (!m_blockSizes.count(ptr)) {
+              return false;
+            }
+            it = m_objectIDs.insert({ ptr, m_objects.size() }).first;
+            m_objects.push_back({ value.value.data.tag, ptr });
+          }
+          word = tagged(value.value.data.tag, (uint64_t)it->second << 1);
+        } else {
+          word = value.encode();
+        }
+        return true;
+      }
+
+      unsigned string(const std::string &str) {
+        auto it = m_stringIDs.find(str);
+        if (it != m_stringIDs.end()) {
+          return it->second;
+        }
+        m_strings.push_back(str);
+        return m_stringIDs[str] = m_strings.size() - 1;
+      }
+
+      // encodes the objects, including the ones found while encoding them
+      bool encodeObjects() {
+        for (size_t i = 0; i < m_objects.size(); i++) {
+          auto tag = m_objects[i].first;
+          auto words = (uint64_t *)m_objects[i].second;
+          std::vector<uint64_t> encoded(m_blockSizes[words]);
+
+          // the header of closures, objects and lists is saved as it is,
+          // apart from the function of closures
+          size_t header = 1;
+          if (tag == Value::ClosureTag) {
+            auto closure = (Closure *)words;
+            auto id = m_functionIDs.find(closure->fn);
+            if (id == m_functionIDs.end()) {
+              return false;
+            }
+            encoded[0] = id->second;
+            encoded[1] = words[1];
+            header = 2;
+          } else {
+            encoded[0] = words[0];
+          }
+
+          for (size_t j = header; j < encoded.size(); j++) {
+            if (!encode(Value::decode(words[j]), encoded[j])) {
+              return false;
+            }
+          }
+          m_encodedObjects.push_back(encoded);
+        }
+        return true;
+      }
+
+      void write(std::ostream &output) {
+        writeWord(output, m_strings.size());
+        for (auto &str : m_strings) {
+          writeWord(output, str.size());
+          output << str;
+          for (auto i = str.size(); i < padded(str.size() + 1); i++) {
+            output.put(0);
+          }
+        }
+
+        writeWord(output, m_objects.size());
+        for (size_t i = 0; i < m_objects.size(); i++) {
+          writeWord(output, m_objects[i].first);
+          writeWord(output, m_encodedObjects[i].size());
+          for (auto word : m_encodedObjects[i]) {
+            writeWord(output, word);
+          }
+        }
+      }
+
+    private:
+      std::unordered_map<void *, size_t> m_blockSizes;
+      std::unordered_map<Function *, unsigned> m_functionIDs;
+      std::vector<std::string> m_strings;
+      std::unordered_map<std::string, unsigned> m_stringIDs;
+      // tag and address of each object
+      std::vector<std::pair<uint16_t, void *>> m_objects;
+      std::unordered_map<void *, unsigned> m_objectIDs;
+      std::vector<std::vector<uint64_t>> m_encodedObjects;
+  };
+
+  bool Snapshot::save(VM &vm, const uint8_t *bytecode, size_t size, const std::string &path) {
+    SnapshotWriter writer(vm);
+
+    // builtins bound to their own name are registered by the VM anyway
+    bool success = true;
+    std::vector<std::pair<unsigned, uint64_t>> globals;
+    vm.m_scope->visitEntries([&](String name, Value value) {
+      if (value.isBuiltin()) {
+        auto builtin = builtinName(value.asBuiltin());
+        if (builtin && strcmp(builtin, name.str()) == 0) {
+          return;
+        }
+      }
+      uint64_t word;
+      success = success && writer.encode(value, word);
+      globals.push_back({ writer.string(name.str()), word });
+    });
+    if (!success || !writer.encodeObjects()) {
+      return false;
+    }
+
+    std::ofstream output(path, std::ios_base::binary);
+    if (!output) {
+      return false;
+    }
+
+    uint32_t header[2] = { Magic, Version };
+    output.write(reinterpret_cast<char *>(header), sizeof(header));
+    auto bytecodeOffset = 4 * WORD_SIZE;
+    writeWord(output, bytecodeOffset);
+    writeWord(output, size);
+    writeWord(output, bytecodeOffset + padded(size));
+    output.write((const char *)bytecode, size);
+    for (auto i = size; i < padded(size); i++) {
+      output.put(0);
+    }
+
+    writer.write(output);
+    writeWord(output, globals.size());
+    for (auto &global : globals) {
+      writeWord(output, global.first);
+      writeWord(output, global.second);
+    }
+    return (bool)output;
+  }
+
+  Snapshot::Snapshot(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) || info.st_size < 4 * WORD_SIZE) {
+      close(fd);
+      return;
+    }
+    m_size = info.st_size;
+    m_image = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m_image == MAP_FAILED) {
+      m_image = NULL;
+    }
+  }
+
+  Snapshot::~Snapshot() {
+    if (m_image) {
+      munmap(m_image, m_size);
+    }
+  }
+
+  const uint8_t *Snapshot::bytecode(size_t &size) {
+    if (!m_image) {
+      return NULL;
+    }
+
+    auto words = (const uint64_t *)m_image;
+    auto header = (const uint32_t *)words;
+    if (header[0] != Magic || header[1] != Version || words[1] + words[2] > m_size || words[3] > m_size) {
+      return NULL;
+    }
+    size = words[2];
+    return (const uint8_t *)m_image + words[1];
+  }
+
+  void Snapshot::restore(VM &vm) {
+    auto words = (const uint64_t *)((const uint8_t *)m_image + ((const uint64_t *)m_image)[3]);
+
+    std::vector<const char *> strings(*words++);
+    for (auto &str : strings) {
+      auto length = *words++;
+      str = (const char *)words;
+      words += padded(length + 1) / WORD_SIZE;
+    }
+
+    // every object is allocated before any is filled, since they may refer
+    // to the ones that follow. They're only reachable once the globals are
+    // set, so the GC must not run until then.
+    std::vector<std::pair<uint16_t, const uint64_t *>> encoded(*words++);
+    std::vector<uint64_t *> objects;
+    for (auto &object : encoded) {
+      auto tag = *words++;
+      auto size = *words++;
+      object = { tag, words };
+      objects.push_back((uint64_t *)calloc(size, WORD_SIZE));
+      vm.blocks.push_back({ size, objects.back() });
+      vm.heapSize += size;
+      words += size;
+    }
+
+    auto decode = [&](uint64_t word) {
+      auto value = Value::decode(word);
+      auto payload = Value::unmask(word);
+      if (value.isString()) {
+        return Value(String(strings[payload]));
+      } else if (value.isBuiltin()) {
+        return vm.m_scope->get(strings[payload]);
+      } else if (value.isList()) {
+        return Value((List *)objects[payload >> 1]);
+      } else if (value.isObject()) {
+        return Value((Object *)objects[payload >> 1]);
+      } else if (value.isClosure() && !isFastClosure(value)) {
+        return Value((Closure *)objects[payload >> 1]);
+      }
+      return value;
+    };
+
+    for (size_t i = 0; i < objects.size(); i++) {
+      auto tag = encoded[i].first;
+      auto source = encoded[i].second;
+      auto object = objects[i];
+      auto size = vm.blocks[vm.blocks.size() - objects.size() + i].first;
+
+      size_t header = 1;
+      if (tag == Value::ClosureTag) {
+        ((Closure *)object)->fn = &vm.function(source[0]);
+        object[1] = source[1];
+        header = 2;
+      } else {
+        object[0] = source[0];
+      }
+      for (size_t j = header; j < size; j++) {
+        object[j] = decode(source[j]).encode();
+      }
+    }
+
+    // builtins are looked up by name before any global can shadow them
+    std::vector<std::pair<const char *, Value>> globals(*words++);
+    for (auto &global : globals) {
+      global.first = strings[words[0]];
+      global.second = decode(words[1]);
+      words += 2;
+    }
+    for (auto &global : globals) {
+      vm.m_scope->set(global.first, global.second);
+    }
+
+    vm.heapLimit = std::max(vm.heapLimit, 2 * vm.heapSize);
+  }
+
+}
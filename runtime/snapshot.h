@@ -0,0 +1,52 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#pragma once
+
+namespace Verve {
+  class VM;
+
+  // An image of the VM once the top-level code of a program has run: its
+  // bytecode, the values bound in the global scope and the heap objects
+  // they reach. Loading it maps the file, runs the bytecode in place and
+  // rebuilds the globals and the heap without running any code, so only the
+  // entry point runs.
+  //
+  // Heap and builtin addresses change from a run to the next, so values
+  // that point to them keep their tag and have the index of the object, or
+  // of the name of the builtin, as payload. Object indices are shifted left
+  // by one, since a set low bit marks fast closures. All sizes are in words:
+  //   magic (4 bytes), version (4 bytes), offset and size in bytes of the
+  //   bytecode, offset in bytes of the state
+  //   the bytecode, padded to a word
+  //   number of strings, then for each its length in bytes and its
+  //   characters, NUL terminated and padded to a word: the contents of
+  //   string values, and the names of builtins and of globals
+  //   number of objects, then for each its tag, number of words and words.
+  //   A closure starts with the id of its function instead of a pointer.
+  //   number of globals, then for each the index of its name and its value
+  class Snapshot {
+    public:
+      // saves `vm` once it has run `bytecode`, returns whether it succeeded
+      static bool save(VM &vm, const uint8_t *bytecode, size_t size, const std::string &path);
+
+      Snapshot(const std::string &path);
+      ~Snapshot();
+
+      // the bytecode of a valid image, or NULL
+      const uint8_t *bytecode(size_t &size);
+
+      // restores the globals and the heap into `vm`, once it has loaded the
+      // bytecode of the image
+      void restore(VM &vm);
+
+      static const uint32_t Magic = 0x53565256; // "VRVS"
+      static const uint32_t Version = 1;
+
+    private:
+      void *m_image = NULL;
+      size_t m_size = 0;
+  };
+
+}
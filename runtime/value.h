@@ -1,5 +1,6 @@
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -24,34 +25,45 @@ namespace Verve {
     Value at(unsigned index);
   };
 
+  // Values are NaN-boxed in a 64-bit word. Doubles are stored unboxed, with
+  // `DoubleOffset` added to their bits, so that at least one of their top 13
+  // bits is set. Every other value leaves them clear and keeps its tag in
+  // bits 48 to 50, above a 48-bit payload: ints are 32 bits wide and zero
+  // extended (tag 0), pointers are stored as they are. The doubles that the
+  // offset wraps around are negative NaNs, so every NaN is stored as the
+  // canonical positive one.
   struct Value {
     union {
       uint64_t raw;
       uintptr_t ptr;
       struct {
         int32_t i;
-        uint16_t __;
-        uint8_t _;
-        uint8_t tag;
+        uint16_t _;
+        // the top 16 bits, past the last tag for doubles
+        uint16_t tag;
       } data;
     } value;
 
+    static const uint64_t DoubleOffset = 1ull << 51;
+    static const uint64_t CanonicalNaN = 0x7FF8000000000000ull;
+
 #define TAG(NAME, VALUE) \
-    static const uint8_t NAME##Tag = VALUE; \
+    static const uint16_t NAME##Tag = VALUE; \
     ALWAYS_INLINE bool is##NAME() { return value.data.tag == Value::NAME##Tag; }
 
+    // kept in sync with interpreter.S
     TAG(Int, 0); // fast path from assembly
-    TAG(Undefined, 1 << 0);
-    TAG(String,    1 << 1);
-    TAG(List,      1 << 2);
-    TAG(Builtin,   1 << 3);
-    TAG(Closure,   1 << 4);
-    TAG(Object,    1 << 5);
+    TAG(Undefined, 1);
+    TAG(Builtin,   2);
+    TAG(String,    3); // heap allocated from here on
+    TAG(List,      4);
+    TAG(Closure,   5);
+    TAG(Object,    6);
 
 #undef TAG
 
     ALWAYS_INLINE static uintptr_t unmask(uintptr_t ptr) {
-      return 0xFFFFFFFFFFFFFF & ptr;
+      return 0xFFFFFFFFFFFF & ptr;
     }
 
     ALWAYS_INLINE Value() {
@@ -66,6 +78,24 @@ namespace Verve {
 
     ALWAYS_INLINE int asInt() { return value.data.i; }
 
+    ALWAYS_INLINE Value(double d) {
+      if (d != d) {
+        value.raw = CanonicalNaN;
+      } else {
+        memcpy(&value.raw, &d, sizeof(d));
+      }
+      value.raw += DoubleOffset;
+    }
+
+    ALWAYS_INLINE bool isDouble() { return value.raw >= DoubleOffset; }
+
+    ALWAYS_INLINE double asDouble() {
+      auto bits = value.raw - DoubleOffset;
+      double d;
+      memcpy(&d, &bits, sizeof(d));
+      return d;
+    }
+
 #define POINTER_TYPE(TYPE, NAME) \
     ALWAYS_INLINE Value(TYPE *ptr) { \
       value.ptr = reinterpret_cast<uintptr_t>(ptr); \
@@ -107,7 +137,7 @@ namespace Verve {
     }
 
     ALWAYS_INLINE bool isHeapAllocated() {
-      return value.data.tag & (Value::ClosureTag | Value::ListTag | Value::StringTag | Value::ObjectTag);
+      return value.data.tag >= Value::StringTag && value.data.tag <= Value::ObjectTag;
     }
 
     ALWAYS_INLINE uint64_t encode() {
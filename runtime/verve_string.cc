@@ -3,6 +3,7 @@
 namespace Verve {
 
 unsigned String::s_size;
+unsigned String::s_count;
 String::Entry *String::s_strings;
 
 }
@@ -66,15 +66,40 @@ class String {
       throw;
     }
 
+    if (++s_count * 4 > s_size * 3) {
+      grow();
+    }
+
     return str;
   }
 
+  // doubles the size of the table once it's three quarters full, so there's
+  // always an empty entry to end the probing
+  static void grow() {
+    auto strings = s_strings;
+    auto size = s_size;
+    s_size *= 2;
+    s_strings = (Entry *)calloc(s_size, sizeof(Entry));
+    for (unsigned i = 0; i < size; i++) {
+      if (!strings[i].str) {
+        continue;
+      }
+      unsigned index = strings[i].hash % s_size;
+      while (s_strings[index].str != NULL) {
+        index = (index + 1) % s_size;
+      }
+      s_strings[index] = strings[i];
+    }
+    free(strings);
+  }
+
   struct Entry {
     unsigned hash;
     const char *str;
   };
   static const unsigned s_initialSize = 64;
   static unsigned s_size;
+  static unsigned s_count;
   static Entry *s_strings;
 
   const char *m_str;
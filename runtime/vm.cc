@@ -1,9 +1,11 @@
 #include "vm.h"
 
+#include "bytecode/compact.h"
 #include "bytecode/opcodes.h"
 #include "bytecode/sections.h"
 
 #include <cassert>
+#include <pthread.h>
 
 namespace Verve {
 
@@ -16,45 +18,11 @@ extern "C" void execute(
 
 extern "C" void setScope(VM *vm, const char *name, Value value);
 void setScope(VM *vm, const char *name, Value value) {
-  vm->m_scope->set(name, value);
-}
-
-extern "C" void pushScope(VM *vm);
-void pushScope(VM *vm) {
-  vm->m_scope = vm->m_scope->create();
-}
-
-extern "C" void restoreScope(VM *vm);
-void restoreScope(VM *vm) {
-  vm->m_scope = vm->m_scope->restore();
-}
-
-extern "C" uint64_t createClosure(VM *vm, unsigned fnID, bool capturesScope);
-uint64_t createClosure(VM *vm, unsigned fnID, bool capturesScope) {
-  if (capturesScope) {
-    auto closure = new Closure();
-    closure->scope = vm->m_scope->inc();
-    vm->trackAllocation(closure, sizeof(Closure));
-    closure->fn = &vm->m_userFunctions[fnID];
-    return Value(closure).encode();
-  } else {
-    return Value::fastClosure(vm->m_userFunctions[fnID].offset).encode();
-  }
-}
-
-extern "C" unsigned prepareClosure(unsigned argc, Value *argv, VM *vm, Closure *closure);
-unsigned prepareClosure(__unused unsigned argc, __unused Value *argv, VM *vm, Closure *closure) {
-  if (closure->scope != NULL) {
-    vm->m_scope = vm->m_scope->create(closure->scope);
-  }
-  return closure->fn->offset;
-}
-
-extern "C" void finishClosure(VM *vm, Closure *closure);
-void finishClosure(VM *vm, Closure *closure) {
-  if (closure->scope) {
-    vm->m_scope = vm->m_scope->restore();
+  // lookups of the name may have cached the value being shadowed
+  if (!vm->m_scope->get(name).isUndefined()) {
+    memset(vm->m_lookupTable, 0, vm->m_lookupTableSize * WORD_SIZE);
   }
+  vm->m_scope->set(name, value);
 }
 
 extern "C" void symbolNotFound(char *);
@@ -76,95 +44,156 @@ uintptr_t allocate(VM *vm, unsigned size) {
   return reinterpret_cast<uintptr_t>(address);
 }
 
-  void VM::execute() {
-    auto header = read<uint64_t>();
-    assert(header == Section::Header);
+// The captured values are on the stack, the last one on top
+extern "C" uint64_t createClosure(VM *vm, unsigned fnID, unsigned size, Value *captures);
+uint64_t createClosure(VM *vm, unsigned fnID, unsigned size, Value *captures) {
+  if (!size) {
+    return Value::fastClosure(vm->functionOffset(fnID)).encode();
+  }
+
+  auto &fn = vm->function(fnID);
+  auto closure = (Closure *)allocate(vm, size + 2);
+  closure->fn = &fn;
+  closure->offset = fn.offset;
+  closure->size = size;
+  for (unsigned i = 0; i < size; i++) {
+    ((Value *)closure)[i + 2] = captures[size - i - 1];
+  }
+  return Value(closure).encode();
+}
+
+// The call site's cache is empty, or held another closure
+extern "C" void fillCallCache(VM *vm, uint64_t *cache, uint64_t callee, const uint8_t *bcbase);
+void fillCallCache(VM *vm, uint64_t *cache, uint64_t callee, const uint8_t *bcbase) {
+  if (cache[0] != CALL_CACHE_EMPTY) {
+    cache[0] = CALL_CACHE_MEGAMORPHIC;
+    vm->m_megamorphicCallSites++;
+    return;
+  }
 
-    loadStrings();
-    loadFunctions();
-    loadText();
+  cache[0] = callee;
+  cache[1] = (uint64_t)(bcbase + Closure::entryOffset(callee));
+  if (!(Value::unmask(callee) & 1)) {
+    vm->m_closureCallCaches.push_back(cache);
   }
+}
 
-  inline void VM::loadStrings() {
+  void VM::execute() {
+    load();
+    run(m_bytecode + pc);
+  }
+
+  // Reads the table of contents, see bytecode/sections.h. Sections that are
+  // missing are empty.
+  void VM::load() {
     auto header = read<uint64_t>();
-    if (header != Section::Strings) {
-      pc -= WORD_SIZE;
-      return;
+    assert(header == Section::Header);
+    auto version = read<uint64_t>();
+    if (version != Section::Version) {
+      fprintf(stderr, "Unsupported bytecode version: %llu (expected %d)\n", (unsigned long long)version, Section::Version);
+      throw;
+    }
+    // only the C++ engine runs compact code
+    m_encoding = (Section::Encoding)read<uint64_t>();
+    if (m_encoding == Section::Compact) {
+      m_engine = Engine::Cxx;
     }
 
-    while (true) {
-      auto header = read<uint64_t>();
+    uint64_t offsets[Section::Text + 1] = {};
+    auto sections = read<uint64_t>();
+    for (unsigned i = 0; i < sections; i++) {
+      auto type = read<uint64_t>();
+      auto offset = read<uint64_t>();
+      read<uint64_t>(); // length
+      assert(type <= Section::Text && offset < length);
+      offsets[type] = offset;
+    }
 
-      if (header == Section::Header) {
-        break;
-      }
+    loadStrings(offsets[Section::Strings]);
+    loadFunctions(offsets[Section::Functions]);
+    loadText(offsets[Section::Text]);
+  }
 
-      pc -= sizeof(header);
-      String str = readStr();
-      m_stringTable.push_back(str);
+  inline void VM::loadStrings(uint64_t offset) {
+    if (!offset) {
+      return;
+    }
 
-      while (m_bytecode[pc] == '\1') pc++;
+    auto section = (const uint64_t *)(m_bytecode + offset);
+    auto count = section[0];
+    m_stringTable.reserve(count);
+    for (unsigned i = 0; i < count; i++) {
+      m_stringTable.push_back(String((const char *)section + section[1 + i]));
     }
   }
 
-  inline void VM::loadFunctions() {
-    auto header = read<uint64_t>();
-    if (header != Section::Functions) {
-      pc -= WORD_SIZE;
+  // Functions are only loaded from their entry in the table once a closure
+  // capturing values is created for them or they're compiled: calls and
+  // closures without captures only need the offset of the code, read from
+  // the table, so starting up doesn't depend on the number of functions
+  inline void VM::loadFunctions(uint64_t offset) {
+    if (!offset) {
       return;
     }
 
-    auto initialHeader = read<uint64_t>();
-    assert(initialHeader == Section::FunctionHeader);
+    auto section = (const uint64_t *)(m_bytecode + offset);
+    m_functionTable = section + 1;
+    m_userFunctions.resize(section[0]);
+  }
 
-    while (true) {
-      auto fnid = read<uint64_t>();
-      auto nargs = read<uint64_t>();
+  Function &VM::function(unsigned id) {
+    auto &fn = m_userFunctions[id];
+    if (!fn) {
+      auto entry = m_functionTable + id * Section::FunctionEntrySize;
+      auto argNames = m_functionTable + m_userFunctions.size() * Section::FunctionEntrySize;
+      auto nargs = entry[1];
 
       std::vector<String> args;
-      for (unsigned i = 0; i < nargs; i++) {
-        auto argID = read<uint64_t>();
-        args.push_back(m_stringTable[argID]);
-      }
-      m_userFunctions.push_back(Function(fnid, nargs, pc, std::move(args)));
-
-      linkBytecode();
-      while (true) {
-        auto opcode = read<uint64_t>();
-        if (opcode == Section::Header) {
-          return;
-        } else if (opcode == Section::FunctionHeader) {
-          break;
-        }
+      for (unsigned j = 0; j < nargs; j++) {
+        args.push_back(m_stringTable[argNames[entry[2] + j]]);
       }
+      fn = new Function(entry[0], nargs, entry[3], entry[4], std::move(args));
     }
+    return *fn;
   }
 
-  inline void VM::loadText()  {
-    auto header = read<uint64_t>();
-    if (header != Section::Text) {
-      pc -= WORD_SIZE;
+  inline void VM::loadText(uint64_t offset) {
+    if (!offset) {
       return;
     }
 
-    auto lookupTableSize = read<uint64_t>();
-    void *lookupTable = calloc(lookupTableSize * WORD_SIZE, 1);
-    linkBytecode();
-    ::Verve::execute(m_bytecode + pc, &m_stringTable[0], this, m_bytecode, lookupTable);
-  }
-
-  void VM::linkBytecode() {
-    if (m_needsLinking) {
-      auto bytecode = (uint64_t *)m_bytecode;
-      for (auto i = pc; i < length; i += WORD_SIZE) {
-        auto value = bytecode[i / WORD_SIZE];
-        if (value == Section::Header || value == Section::FunctionHeader) {
-          return;
-        }
-        auto opcode = (Opcode::Type)value;
-        bytecode[i / WORD_SIZE] = Opcode::address(opcode);
-        i += Opcode::size(opcode) * WORD_SIZE;
-      }
+    pc = offset;
+    m_lookupTableSize = read<uint64_t>();
+    m_lookupTable = (uint64_t *)calloc(m_lookupTableSize, WORD_SIZE);
+    // the last call cache is used by `call`
+    m_callCacheCount = read<uint64_t>() + 1;
+    m_callCaches = (uint64_t *)calloc(2 * m_callCacheCount, WORD_SIZE);
+    m_jitEntries = (uint64_t *)calloc(m_userFunctions.size(), WORD_SIZE);
+  }
+
+  void VM::run(const void *code) {
+    if (m_engine == Engine::Cxx) {
+      CxxInterpreter::execute((const uint8_t *)code, &m_stringTable[0], this, m_bytecode, m_lookupTable);
+    } else {
+      ::Verve::execute((const uint8_t *)code, &m_stringTable[0], this, m_bytecode, m_lookupTable);
+    }
+  }
+
+  // Runs `push callee, call 0, exit`, in the encoding of the bytecode
+  void VM::call(Value callee) {
+    auto cacheSlot = m_callCacheCount - 1;
+    if (m_encoding == Section::Compact) {
+      std::string code;
+      code.push_back(Opcode::push);
+      CompactEncoding::writeOperand(code, callee.encode());
+      code.push_back(Opcode::call);
+      CompactEncoding::writeOperand(code, 0);
+      CompactEncoding::writeOperand(code, cacheSlot);
+      code.push_back(Opcode::exit);
+      run(code.data());
+    } else {
+      uint64_t code[] = { Opcode::push, callee.encode(), Opcode::call, 0, cacheSlot, Opcode::exit };
+      run(code);
     }
   }
 
@@ -179,22 +208,63 @@ uintptr_t allocate(VM *vm, unsigned size) {
     blocks.push_back(std::make_pair(size, ptr));
   }
 
+  void *VM::stackBottom() {
+    static void *stackBottom = NULL;
+    if (stackBottom) {
+      return stackBottom;
+    }
+
+    pthread_t self = pthread_self();
+#ifdef __APPLE__
+    stackBottom = pthread_get_stackaddr_np(self);
+#else
+    pthread_attr_t attr;
+    void *stackAddr;
+    size_t stackSize;
+    pthread_getattr_np(self, &attr);
+    pthread_attr_getstack(&attr, &stackAddr, &stackSize);
+    pthread_attr_destroy(&attr);
+    stackBottom = (uint8_t *)stackAddr + stackSize;
+#endif
+    return stackBottom;
+  }
+
   void VM::collect() {
     GC::start();
 
     volatile void **rsp;
     asm("movq %%rsp, %0" : "=r"(rsp));
 
-    pthread_t self = pthread_self();
-    void *stackBottom = pthread_get_stackaddr_np(self);
+    void *stackBottom = VM::stackBottom();
     while (rsp != stackBottom) {
       GC::markValue(Value::decode((uintptr_t)*rsp), blocks);
       rsp++;
     }
 
+    for (auto sp = m_sp; sp && sp != m_stackEnd; sp++) {
+      GC::markValue(Value::decode(*sp), blocks);
+    }
+
     GC::markScope(m_scope, blocks);
 
     GC::sweep(blocks, &heapSize);
+
+    for (auto cache : m_closureCallCaches) {
+      if (cache[0] != CALL_CACHE_MEGAMORPHIC) {
+        cache[0] = CALL_CACHE_EMPTY;
+        cache[1] = 0;
+      }
+    }
+    m_closureCallCaches.clear();
+  }
+
+  void VM::printStats(FILE *out) {
+    auto calls = m_callCacheHits + m_callCacheMisses;
+    fprintf(out, "call inline caches: %llu/%llu hits (%.1f%%), %u megamorphic sites\n",
+        (unsigned long long)m_callCacheHits,
+        (unsigned long long)calls,
+        calls ? 100.0 * m_callCacheHits / calls : 0.0,
+        m_megamorphicCallSites);
   }
 
 }
@@ -3,9 +3,14 @@
 #include "closure.h"
 #include "gc.h"
 #include "function.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "opcode_profile.h"
 #include "scope.h"
 #include "value.h"
 
+#include "bytecode/sections.h"
+
 #include <iostream>
 #include <sstream>
 #include <vector>
@@ -16,25 +21,48 @@ namespace Verve {
 
   class VM {
     public:
-      VM(uint8_t *bytecode, size_t len, bool needsLinking = false):
+      VM(const uint8_t *bytecode, size_t len, Engine engine = Engine::Asm):
         m_scope(new Scope(32)),
+        m_functionTable(NULL),
+        m_callCacheHits(0),
+        m_callCacheMisses(0),
+        m_callCaches(NULL),
+        m_jitEntries(NULL),
         pc(0),
         length(len),
         heapSize(0),
         heapLimit(10240),
-        m_needsLinking(needsLinking),
+        m_engine(engine),
         m_bytecode(bytecode)
       {
         registerBuiltins(*this);
       }
 
+      ~VM() {
+        for (auto fn : m_userFunctions) {
+          delete fn;
+        }
+        free(m_lookupTable);
+        free(m_callCaches);
+        free(m_jitEntries);
+      }
+
       void execute();
-      void linkBytecode();
-      inline void loadStrings();
-      inline void loadFunctions();
-      inline void loadText();
+      // reads the bytecode, without running it
+      void load();
+      // calls a closure, or a builtin, without arguments, once loaded
+      void call(Value callee);
+      inline void loadStrings(uint64_t offset);
+      inline void loadFunctions(uint64_t offset);
+      inline void loadText(uint64_t offset);
+      Function &function(unsigned id);
+      ALWAYS_INLINE uint64_t functionOffset(unsigned id) {
+        return m_functionTable[id * Section::FunctionEntrySize + 3];
+      }
       void trackAllocation(void *, size_t);
       void collect();
+      void printStats(FILE *);
+      static void *stackBottom();
 
       template<typename T>
       inline T read() {
@@ -43,13 +71,20 @@ namespace Verve {
         return v;
       }
 
-      String readStr() {
-        char *v = (char *)(m_bytecode + pc);
-        pc += strlen(v) + 1;
-        return String(v);
-      }
-
       Scope *m_scope; // first thing, easy to access from asm
+      // entries of the function table in the bytecode, see
+      // bytecode/sections.h. `call_direct` reads the offset of its callee
+      // straight from it.
+      const uint64_t *m_functionTable;
+      // closure calls through `call`, updated from asm
+      uint64_t m_callCacheHits;
+      uint64_t m_callCacheMisses;
+      // inline caches of the `call` sites, indexed by their second operand:
+      // the bytecode is never written, so they live here
+      uint64_t *m_callCaches;
+      // native code of the functions compiled by the JIT, indexed by
+      // function id, entered by `jit_count`
+      uint64_t *m_jitEntries;
 
       unsigned pc;
       size_t length;
@@ -57,11 +92,31 @@ namespace Verve {
       size_t heapLimit;
       std::vector<std::pair<size_t, void *>> blocks;
 
-      bool m_needsLinking;
       std::vector<String> m_stringTable;
-      std::vector<Function> m_userFunctions;
+      // indexed by function id, NULL until `function` loads them
+      std::vector<Function *> m_userFunctions;
+      // values cached by `lookup`, indexed by its second operand
+      uint64_t *m_lookupTable = NULL;
+      size_t m_lookupTableSize = 0;
+      size_t m_callCacheCount = 0;
+
+      Engine m_engine;
+      Section::Encoding m_encoding = Section::Wide;
+      // operand stack of the C++ engine, scanned by the GC
+      uint64_t *m_sp = NULL;
+      uint64_t *m_stackEnd = NULL;
+      // set to count the opcodes executed, only supported by the C++ engine
+      OpcodeProfile *m_profile = NULL;
+      // compiles hot functions, only supported by the assembly engine
+      Jit *m_jit = NULL;
+      // call sites caching a heap closure, emptied by the GC since the
+      // closure may be freed and its address reused
+      std::vector<uint64_t *> m_closureCallCaches;
+      unsigned m_megamorphicCallSites = 0;
 
     private:
-      uint8_t *m_bytecode;
+      void run(const void *code);
+
+      const uint8_t *m_bytecode;
   };
 }
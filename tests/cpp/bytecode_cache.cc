@@ -0,0 +1,70 @@
+#include "bytecode/cache.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+namespace Verve {
+
+class BytecodeCacheTest {
+  public:
+
+  static void writeFile(const std::string &path, const std::string &contents) {
+    std::ofstream file(path, std::ios_base::binary);
+    file << contents;
+  }
+
+  static bool hits(const std::string &program, const std::string &configuration, const std::string &expected) {
+    BytecodeCache cache(program, configuration);
+    size_t size;
+    auto bytecode = cache.lookup(size);
+    if (!bytecode) {
+      return false;
+    }
+    // the bytecode is word aligned, as the VM reads it
+    assert((uintptr_t)bytecode % 8 == 0);
+    return std::string((const char *)bytecode, size) == expected;
+  }
+
+  static void test() {
+    char directory[] = "/tmp/verve_cache_XXXXXX";
+    assert(mkdtemp(directory));
+    setenv("XDG_CACHE_HOME", directory, 1);
+
+    auto program = std::string(directory) + "/program.vrv";
+    auto import = std::string(directory) + "/import.vrv";
+    writeFile(program, "print(1)\n");
+    writeFile(import, "fn f() -> int { 1 }\n");
+    std::string bytecode("\x05\xCE\0\0\0\0\0\0 bytecode", 17);
+
+    assert(!hits(program, "-O2", bytecode));
+    BytecodeCache(program, "-O2").store(bytecode, { import, program }, 1.0);
+    assert(hits(program, "-O2", bytecode));
+
+    // another configuration has its own entry
+    assert(!hits(program, "-O0", bytecode));
+
+    // changing a dependency invalidates the entry
+    writeFile(import, "fn f() -> int { 2 }\n");
+    assert(!hits(program, "-O2", bytecode));
+    BytecodeCache(program, "-O2").store(bytecode, { import, program }, 1.0);
+    assert(hits(program, "-O2", bytecode));
+
+    // so does removing it
+    unlink(import.c_str());
+    assert(!hits(program, "-O2", bytecode));
+
+    system((std::string("rm -rf ") + directory).c_str());
+  }
+
+};
+
+}
+
+int main() {
+  Verve::BytecodeCacheTest::test();
+  return 0;
+}
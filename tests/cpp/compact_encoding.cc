@@ -0,0 +1,89 @@
+#include "bytecode/compact.h"
+#include "bytecode/opcodes.h"
+
+#include <cassert>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace Verve {
+
+class CompactEncodingTest {
+  public:
+
+  static std::string wide(const std::vector<int64_t> &words) {
+    return std::string((const char *)words.data(), words.size() * WORD_SIZE);
+  }
+
+  static void testOperands() {
+    auto min = std::numeric_limits<int64_t>::min();
+    auto max = std::numeric_limits<int64_t>::max();
+    for (int64_t value : { (int64_t)0, (int64_t)1, (int64_t)-1, (int64_t)63, (int64_t)64, (int64_t)-64, (int64_t)-65, (int64_t)0xCE05, min, max }) {
+      std::string output;
+      CompactEncoding::writeOperand(output, value);
+      auto p = (const uint8_t *)output.data();
+      assert(CompactEncoding::readOperand(p) == value);
+      assert(p == (const uint8_t *)output.data() + output.size());
+    }
+
+    // small operands take a byte
+    std::string output;
+    CompactEncoding::writeOperand(output, -64);
+    assert(output.size() == 1);
+
+    // padded operands take the same space whatever their value
+    for (int64_t value : { 0, 1, -1, 1000, -1000 }) {
+      std::string padded;
+      CompactEncoding::writeOperand(padded, value, CompactEncoding::JumpSize);
+      assert(padded.size() == CompactEncoding::JumpSize);
+      auto p = (const uint8_t *)padded.data();
+      assert(CompactEncoding::readOperand(p) == value);
+      p = (const uint8_t *)padded.data();
+      CompactEncoding::skipOperand(p);
+      assert(p == (const uint8_t *)padded.data() + padded.size());
+    }
+  }
+
+  // jumps still land on the instructions they targeted
+  static void testJumps() {
+    auto code = wide({
+      Opcode::push, 0,                      // 0
+      Opcode::jz, 4 * WORD_SIZE,            // 2: to 6
+      Opcode::push_arg, 300,                // 4
+      Opcode::jmp, -6 * WORD_SIZE,          // 6: to 0
+      Opcode::ret,                          // 8
+    });
+
+    auto compact = CompactEncoding::encode(code);
+    std::vector<size_t> starts = { 0, 2, 2 + 1 + CompactEncoding::JumpSize, 2 + 1 + CompactEncoding::JumpSize + 3 };
+    starts.push_back(starts[3] + 1 + CompactEncoding::JumpSize);
+    assert(compact.size() == starts[4] + 1);
+
+    auto bytes = (const uint8_t *)compact.data();
+    assert(bytes[starts[1]] == Opcode::jz);
+    auto p = bytes + starts[1] + 1;
+    assert((int64_t)starts[1] + CompactEncoding::readOperand(p) == (int64_t)starts[3]);
+
+    assert(bytes[starts[2]] == Opcode::push_arg);
+    p = bytes + starts[2] + 1;
+    assert(CompactEncoding::readOperand(p) == 300);
+
+    assert(bytes[starts[3]] == Opcode::jmp);
+    p = bytes + starts[3] + 1;
+    assert((int64_t)starts[3] + CompactEncoding::readOperand(p) == 0);
+    assert(bytes[starts[4]] == Opcode::ret);
+  }
+
+  static void test() {
+    testOperands();
+    testJumps();
+  }
+
+};
+
+}
+
+int main() {
+  Verve::CompactEncodingTest::test();
+  return 0;
+}
@@ -0,0 +1,122 @@
+#include "bytecode/disassembler.h"
+#include "bytecode/generator.h"
+#include "parser/lexer.h"
+#include "parser/optimizer.h"
+#include "parser/parser.h"
+
+#include <cassert>
+#include <fstream>
+#include <glob.h>
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace Verve {
+
+class PeepholeTest {
+  public:
+
+  // The disassembly of `source`, after the AST optimizations of `level`
+  static std::string disassemble(const std::string &source, unsigned level, bool usePeephole) {
+    Lexer lexer("", source.c_str());
+    Parser parser(lexer, "tests");
+    auto ast = parser.parse();
+
+    Optimizer optimizer(ast, level);
+    optimizer.optimize();
+
+    Generator generator(ast);
+    generator.m_usePeephole = usePeephole;
+    auto &bytecode = generator.generate();
+
+    std::stringstream output;
+    auto cout = std::cout.rdbuf(output.rdbuf());
+    Disassembler(bytecode).dump();
+    std::cout.rdbuf(cout);
+    return output.str();
+  }
+
+  static unsigned lines(const std::string &disassembly) {
+    unsigned count = 0;
+    for (auto c : disassembly) {
+      count += c == '\n';
+    }
+    return count;
+  }
+
+  static bool contains(const std::string &disassembly, const std::string &instruction) {
+    return disassembly.find("  " + instruction + "\n") != std::string::npos ||
+      disassembly.find("  " + instruction + " ") != std::string::npos;
+  }
+
+  // The snippets are compiled at -O0, which leaves the redundancies of the
+  // generator for the peephole pass
+
+  static void testStoreLoad() {
+    auto source = "fn f(x: int) -> void {\n  let y = x + 1 {\n    print(y)\n  }\n}\nf(1)\n";
+    auto before = disassemble(source, 0, false);
+    auto after = disassemble(source, 0, true);
+    assert(contains(before, "stack_store"));
+    assert(!contains(after, "stack_store"));
+    assert(!contains(after, "stack_load"));
+    assert(lines(after) < lines(before));
+  }
+
+  static void testConstantCondition() {
+    auto source = "if 1 {\n  print(1)\n} else {\n  print(2)\n}\nif 0 {\n  print(3)\n}\n";
+    auto before = disassemble(source, 0, false);
+    auto after = disassemble(source, 0, true);
+    assert(contains(before, "jz"));
+    assert(!contains(after, "jz"));
+    assert(lines(after) < lines(before));
+  }
+
+  static void testEmptyFrame() {
+    auto source = "type box {\n  Box(int)\n}\nfn f() -> int {\n  let b = Box(1) {\n    2\n  }\n}\nprint(f())\n";
+    auto before = disassemble(source, 0, false);
+    auto after = disassemble(source, 0, true);
+    assert(!contains(after, "stack_alloc"));
+    assert(lines(after) <= lines(before));
+  }
+
+  // Every test program, compiled at the default level, gets smaller or stays
+  // the same if it has nothing to remove, and they shrink overall
+  static void testPrograms() {
+    glob_t programs;
+    glob("tests/*.vrv", 0, nullptr, &programs);
+    assert(programs.gl_pathc > 0);
+
+    unsigned before = 0, after = 0;
+    for (size_t i = 0; i < programs.gl_pathc; i++) {
+      std::ifstream file(programs.gl_pathv[i]);
+      std::stringstream source;
+      source << file.rdbuf();
+
+      auto unoptimized = lines(disassemble(source.str(), Optimizer::DefaultLevel, false));
+      auto optimized = lines(disassemble(source.str(), Optimizer::DefaultLevel, true));
+      assert(optimized <= unoptimized);
+      before += unoptimized;
+      after += optimized;
+    }
+    globfree(&programs);
+
+    assert(after < before);
+  }
+
+  static void test() {
+    testStoreLoad();
+    testConstantCondition();
+    testEmptyFrame();
+    testPrograms();
+  }
+
+};
+
+}
+
+int main() {
+  ROOT_DIR = ".";
+  Verve::PeepholeTest::test();
+  return 0;
+}
@@ -1,5 +1,4 @@
 #include "runtime/scope.h"
-#include "runtime/closure.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,16 +15,16 @@ class ScopeTest {
     assert(tmp->refCount == 0);
   }
 
-  static void testClosure() {
+  static void testCapturedParent() {
     {
       // parent == previous
       auto global = new Scope();
-      auto closure = new Closure(global);
-      auto tmp = global->create(closure->scope);
+      auto captured = global->inc();
+      auto tmp = global->create(captured);
       tmp->restore();
       assert(tmp->refCount == 0);
       assert(global->refCount == 2);
-      delete closure;
+      captured->dec();
       assert(global->refCount == 1);
     }
 
@@ -33,8 +32,8 @@ class ScopeTest {
       // parent != previous
       auto global = new Scope();
       auto tmp = global->create();
-      auto closure = new Closure(global);
-      auto tmp2 = tmp->create(closure->scope);
+      auto captured = global->inc();
+      auto tmp2 = tmp->create(captured);
       assert(tmp2->refCount == 1);
       assert(tmp->refCount == 2);
       assert(global->refCount == 4);
@@ -48,14 +47,30 @@ class ScopeTest {
       assert(tmp->refCount == 0);
       assert(global->refCount == 2);
 
-      delete closure;
+      captured->dec();
       assert(global->refCount == 1);
     }
   }
 
+  // the table grows more than once, and keeps every entry
+  static void testResize() {
+    auto global = new Scope(32);
+    // interned strings are referenced, not copied
+    char names[200][16];
+    for (int i = 0; i < 200; i++) {
+      snprintf(names[i], sizeof(names[i]), "name%d", i);
+      global->set(String(names[i]), Value(i));
+    }
+    assert(global->length == 200);
+    for (int i = 0; i < 200; i++) {
+      assert(global->get(String(names[i])).asInt() == i);
+    }
+  }
+
   static void test() {
     testScopeCreate();
-    testClosure();
+    testCapturedParent();
+    testResize();
   }
 
 };
@@ -0,0 +1,96 @@
+#include "bytecode/generator.h"
+#include "parser/lexer.h"
+#include "parser/optimizer.h"
+#include "parser/parser.h"
+#include "runtime/snapshot.h"
+#include "runtime/vm.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+namespace Verve {
+
+class SnapshotTest {
+  public:
+
+  static std::string compile(const std::string &source) {
+    Lexer lexer("", source.c_str());
+    Parser parser(lexer, "tests");
+    auto ast = parser.parse();
+
+    Optimizer optimizer(ast, Optimizer::DefaultLevel);
+    optimizer.optimize();
+
+    Generator generator(ast);
+    return generator.generate().str();
+  }
+
+  static Object *capturedObject(VM &vm, const char *name) {
+    auto value = vm.m_scope->get(name);
+    assert(value.isClosure());
+    auto capture = value.asClosure()->at(0);
+    assert(capture.isObject());
+    return capture.asObject();
+  }
+
+  // The globals bound by the top-level code, and the objects they capture,
+  // are restored without running it
+  static void test() {
+    auto bytecode = compile(
+      "type pair {\n  Pair(int, string)\n}\n"
+      "fn first(p: pair) -> int {\n  match p {\n    Pair(n, s) => n\n  }\n}\n"
+      "let p = Pair(42, \"hello\") {\n"
+      "  fn main() -> int {\n    first(p)\n  }\n"
+      "  fn other() -> int {\n    first(p) + 1\n  }\n"
+      "}\n");
+
+    char path[] = "/tmp/verve_snapshot_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    {
+      VM vm((const uint8_t *)bytecode.data(), bytecode.size(), Engine::Cxx);
+      vm.execute();
+      assert(Snapshot::save(vm, (const uint8_t *)bytecode.data(), bytecode.size(), path));
+    }
+
+    Snapshot snapshot(path);
+    size_t size;
+    auto image = snapshot.bytecode(size);
+    assert(image && size == bytecode.size());
+    assert(std::string((const char *)image, size) == bytecode);
+
+    VM vm(image, size, Engine::Cxx);
+    vm.load();
+    snapshot.restore(vm);
+
+    assert(vm.m_scope->get("first").isClosure());
+    // builtins are registered by the VM, not saved
+    assert(vm.m_scope->get("print").isBuiltin());
+
+    auto pair = capturedObject(vm, "main");
+    assert(pair->size == 2);
+    assert(pair->at(0).asInt() == 42);
+    assert(pair->at(1).isString());
+    assert(pair->at(1).asString().str() == String("hello").str());
+
+    // objects shared by several values are restored once
+    assert(capturedObject(vm, "other") == pair);
+
+    vm.call(vm.m_scope->get("main"));
+
+    unlink(path);
+  }
+
+};
+
+}
+
+int main() {
+  ROOT_DIR = ".";
+  Verve::SnapshotTest::test();
+  return 0;
+}
@@ -0,0 +1,80 @@
+#include "runtime/value.h"
+
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+namespace Verve {
+
+class ValueTest {
+  public:
+
+  static Value roundTrip(Value value) {
+    return Value::decode(value.encode());
+  }
+
+  // ints keep the zero extended encoding the assembly relies on
+  static void testInts() {
+    for (int i : { 0, 1, -1, std::numeric_limits<int>::min(), std::numeric_limits<int>::max() }) {
+      auto value = roundTrip(Value(i));
+      assert(value.isInt());
+      assert(!value.isDouble());
+      assert(value.asInt() == i);
+      assert(value.encode() == (uint32_t)i);
+    }
+  }
+
+  static void testDoubles() {
+    auto inf = std::numeric_limits<double>::infinity();
+    for (double d : { 0.0, -0.0, 1.5, -1.5, 1e300, -1e-300, inf, -inf, std::numeric_limits<double>::denorm_min() }) {
+      auto value = roundTrip(Value(d));
+      assert(value.isDouble());
+      assert(!value.isInt() && !value.isHeapAllocated());
+      assert(value.asDouble() == d);
+      assert(std::signbit(value.asDouble()) == std::signbit(d));
+    }
+  }
+
+  // the NaN produced by the hardware is negative, which the offset would
+  // wrap around to an int
+  static void testNaNs() {
+    auto negative = -std::numeric_limits<double>::quiet_NaN();
+    for (double d : { std::numeric_limits<double>::quiet_NaN(), negative, 0.0 / 0.0 }) {
+      auto value = roundTrip(Value(d));
+      assert(value.isDouble());
+      assert(std::isnan(value.asDouble()));
+      assert(value.encode() == Value::CanonicalNaN + Value::DoubleOffset);
+    }
+  }
+
+  static void testPointers() {
+    List list = { 3 };
+    auto value = roundTrip(Value(&list));
+    assert(value.isList());
+    assert(value.isHeapAllocated());
+    assert(!value.isDouble() && !value.isObject());
+    assert(value.asList() == &list);
+
+    auto closure = Value::fastClosure(0x100);
+    assert(closure.isClosure());
+    assert(!closure.isDouble());
+
+    assert(Value().isUndefined());
+    assert(!Value().isHeapAllocated());
+  }
+
+  static void test() {
+    testInts();
+    testDoubles();
+    testNaNs();
+    testPointers();
+  }
+
+};
+
+}
+
+int main() {
+  Verve::ValueTest::test();
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include "bytecode/opcodes.h"
+#include "runtime/opcode_profile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+
+// Picks the superinstructions worth having from an opcode profile, collected
+// with `verve --profile-opcodes=<file>`, and prints them as the contents of
+// bytecode/superinstructions.h. Sequences are ranked by the number of
+// dispatches they would have saved.
+
+#define MAX_SUPERINSTRUCTIONS 16
+
+namespace Verve {
+
+#define OPCODE_ENTRY(__op, _) { #__op, Opcode::__op },
+
+static const std::unordered_map<std::string, Opcode::Type> s_opcodes = {
+  EVAL(MAP_2(OPCODE_ENTRY, OPCODES))
+};
+
+struct Candidate {
+  OpcodeProfile::Sequence sequence;
+  uint64_t saved;
+};
+
+static bool isCandidate(const OpcodeProfile::Sequence &sequence) {
+  if (sequence.size() < 2 || sequence.size() > 3) {
+    return false;
+  }
+  for (unsigned i = 0; i < sequence.size(); i++) {
+    auto opcode = s_opcodes.find(sequence[i]);
+    // superinstructions in the profile came from bytecode compiled with them
+    if (opcode == s_opcodes.end() || opcode->second != Opcode::firstComponent(opcode->second)) {
+      return false;
+    }
+    // only the last component may jump
+    if (i < sequence.size() - 1 && !Opcode::isStraightLine(opcode->second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static std::string name(const OpcodeProfile::Sequence &sequence) {
+  std::string name = "super";
+  for (auto &component : sequence) {
+    name += "_" + component;
+  }
+  return name;
+}
+
+static unsigned operands(const std::string &component) {
+  return Opcode::size(s_opcodes.at(component));
+}
+
+static void print(std::vector<Candidate> &candidates) {
+  puts("// Generated by `make superinstructions` from an opcode profile, do not edit.");
+  puts("");
+  puts("#pragma once");
+  puts("");
+
+  puts("// name, number of operands of the first component");
+  puts("#define SUPERINSTRUCTION_OPCODES \\");
+  for (auto &candidate : candidates) {
+    auto &sequence = candidate.sequence;
+    printf("      %s, %u, \\\n", name(sequence).c_str(), operands(sequence[0]));
+  }
+  puts("");
+
+  puts("// X(name, first, its number of operands, last)");
+  puts("#define SUPERINSTRUCTIONS_2(X) \\");
+  for (auto &candidate : candidates) {
+    auto &s = candidate.sequence;
+    if (s.size() == 2) {
+      printf("  X(%s, %s, %u, %s) \\\n", name(s).c_str(), s[0].c_str(), operands(s[0]), s[1].c_str());
+    }
+  }
+  puts("");
+
+  puts("// X(name, first, its number of operands, second, its number of operands, last)");
+  puts("#define SUPERINSTRUCTIONS_3(X) \\");
+  for (auto &candidate : candidates) {
+    auto &s = candidate.sequence;
+    if (s.size() == 3) {
+      printf("  X(%s, %s, %u, %s, %u, %s) \\\n", name(s).c_str(), s[0].c_str(), operands(s[0]), s[1].c_str(), operands(s[1]), s[2].c_str());
+    }
+  }
+  puts("");
+}
+
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: superinstructions <profile>\n");
+    return EXIT_FAILURE;
+  }
+
+  auto counts = Verve::OpcodeProfile::load(argv[1]);
+  if (counts.empty()) {
+    fprintf(stderr, "Error: empty opcode profile `%s`\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Verve::Candidate> candidates;
+  for (auto &entry : counts) {
+    if (Verve::isCandidate(entry.first)) {
+      candidates.push_back({ entry.first, entry.second * (entry.first.size() - 1) });
+    }
+  }
+
+  std::stable_sort(candidates.begin(), candidates.end(), [](const Verve::Candidate &a, const Verve::Candidate &b) {
+    return a.saved > b.saved;
+  });
+  if (candidates.size() > MAX_SUPERINSTRUCTIONS) {
+    candidates.resize(MAX_SUPERINSTRUCTIONS);
+  }
+
+  Verve::print(candidates);
+  return EXIT_SUCCESS;
+}
@@ -9,8 +9,15 @@
 
 namespace Verve {
 
+static std::vector<std::string> s_parsedFiles;
+
+const std::vector<std::string> &parsedFiles() {
+  return s_parsedFiles;
+}
+
 Parser parseFile(std::string filename, std::string dirname, std::string ns) {
   filename = dirname + "/" + filename + ".vrv";
+  s_parsedFiles.push_back(filename);
 
   FILE *source = fopen(filename.c_str(), "r");
   fseek(source, 0, SEEK_END);
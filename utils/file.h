@@ -1,7 +1,11 @@
 #include <string>
+#include <vector>
 
 namespace Verve {
   class Parser;
 
   Parser parseFile(std::string filename, std::string dirname, std::string ns);
+
+  // every file read by `parseFile`: the prelude and the imports
+  const std::vector<std::string> &parsedFiles();
 }
@@ -1,3 +1,15 @@
+#ifndef __unused
+#define __unused __attribute__((unused))
+#endif
+
+#ifndef __used
+#define __used __attribute__((used))
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define _Noreturn __attribute__((noreturn))
+#endif
+
 #define CONCAT(__a, __b) CONCAT_(__a, __b)
 #define CONCAT_(__a, __b) __a##__b
 
@@ -58,3 +70,11 @@
 #define INDEX_OF(ARRAY, ITEM) (std::find(ARRAY.begin(), ARRAY.end(), ITEM) - ARRAY.begin())
 
 #define ALWAYS_INLINE __attribute__((always_inline)) inline
+
+#ifdef __APPLE__
+#define C_SYMBOL(__name) _##__name
+#define NO_EXEC_STACK
+#else
+#define C_SYMBOL(__name) __name
+#define NO_EXEC_STACK .section .note.GNU-stack,"",@progbits
+#endif
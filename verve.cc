@@ -1,15 +1,28 @@
 #define _DARWIN_BETTER_REALPATH
 #include <cassert>
+#include <chrono>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __APPLE__
 #include <mach-o/dyld.h>
+#endif
 
 #include "parser/lexer.h"
+#include "parser/optimizer.h"
 #include "parser/parser.h"
+#include "bytecode/cache.h"
 #include "bytecode/generator.h"
 #include "bytecode/disassembler.h"
+#include "runtime/snapshot.h"
 #include "runtime/vm.h"
+#include "utils/file.h"
 
 void printUsage() {
   puts("Usage:");
@@ -24,16 +37,186 @@ void printUsage() {
 
   printf("  %-30s", "verve -b <input>");
   puts("Execute <input> as verve bytecode");
+
+  printf("  %-30s", "verve --from-snapshot=<image>");
+  puts("Restore the image saved by --snapshot and call its function `main`");
+  printf("  %-30s", "");
+  puts("or the function <entry> when it follows <image>");
+
+  puts("\nOptions (before any of the above):");
+  printf("  %-30s", "-O0|-O1|-O2");
+  printf("Optimization level (default -O%u): -O1 folds constants, prunes constant `if`s, drops unused `let`s\n", Verve::Optimizer::DefaultLevel);
+  printf("  %-30s", "");
+  puts("and removes redundant instructions, -O2 also inlines calls to small functions");
+
+  printf("  %-30s", "--engine=asm|cxx");
+  puts("Select the interpreter: hand-written assembly (default) or portable C++");
+
+  printf("  %-30s", "--bytecode=register|stack");
+  puts("Let int operations read arguments, locals and constants directly (default), or only use the stack");
+
+  printf("  %-30s", "--encoding=wide|compact");
+  puts("Encode opcodes and operands as words (default), or as a byte per opcode and LEB128 operands");
+  printf("  %-30s", "");
+  puts("Compact bytecode is only supported by the C++ engine, and runs on it");
+
+  printf("  %-30s", "--jit[=<calls>]");
+  printf("Compile functions to native code once they have been called <calls> times (default %u)\n", Verve::Jit::DefaultThreshold);
+  printf("  %-30s", "");
+  puts("Only supported by the assembly engine");
+
+  printf("  %-30s", "--stats");
+  puts("Print the hit rate of the call sites' inline caches and of the bytecode cache to stderr");
+
+  printf("  %-30s", "--no-cache");
+  printf("Don't read or write the bytecode cache (%s)\n", Verve::BytecodeCache::directory().c_str());
+
+  printf("  %-30s", "--snapshot=<image>");
+  puts("Once the top-level code of <input> has run, save its globals, heap and bytecode to <image>");
+
+  printf("  %-30s", "--profile-opcodes=<file>");
+  puts("Count the opcode pairs and triples executed and add them to <file>");
+  printf("  %-30s", "");
+  puts("Runs on the C++ engine, without superinstructions");
+}
+
+static bool run(const uint8_t *bytecode, size_t size, Verve::Engine engine, unsigned jitThreshold, const char *profilePath, bool printStats, const char *snapshotPath) {
+  Verve::OpcodeProfile profile;
+  Verve::VM vm(bytecode, size, engine);
+  if (profilePath) {
+    vm.m_profile = &profile;
+  }
+  Verve::Jit jit(&vm, jitThreshold);
+  if (jitThreshold) {
+    vm.m_jit = &jit;
+  }
+  vm.execute();
+  if (printStats) {
+    vm.printStats(stderr);
+  }
+  if (profilePath) {
+    profile.save(profilePath);
+  }
+  if (snapshotPath && !Verve::Snapshot::save(vm, bytecode, size, snapshotPath)) {
+    printf("Error: Cannot save snapshot at `%s`\n", snapshotPath);
+    return false;
+  }
+  return true;
+}
+
+// The top-level code already ran when the image was saved, so only `entry`
+// runs
+static bool runSnapshot(const char *path, const char *entry, Verve::Engine engine, unsigned jitThreshold, bool printStats) {
+  Verve::Snapshot snapshot(path);
+  size_t size;
+  auto bytecode = snapshot.bytecode(size);
+  if (!bytecode) {
+    printf("Error: Cannot read snapshot from `%s`\n", path);
+    return false;
+  }
+
+  Verve::VM vm(bytecode, size, engine);
+  Verve::Jit jit(&vm, jitThreshold);
+  if (jitThreshold) {
+    vm.m_jit = &jit;
+  }
+  vm.load();
+  snapshot.restore(vm);
+
+  auto callee = vm.m_scope->get(entry);
+  if (callee.isUndefined()) {
+    printf("Error: Cannot find `%s` in snapshot `%s`\n", entry, path);
+    return false;
+  }
+  vm.call(callee);
+  if (printStats) {
+    vm.printStats(stderr);
+  }
+  return true;
 }
 
 int main(int argc, char **argv) {
+#ifdef __APPLE__
   char buffer[PATH_MAX];
   uint32_t bufferSize = PATH_MAX;
   _NSGetExecutablePath(buffer, &bufferSize);
+#else
+  const char *buffer = "/proc/self/exe";
+#endif
   char buffer2[PATH_MAX];
   realpath(buffer, buffer2);
+
+  // cached bytecode is only used by the build of verve that generated it
+  struct stat executable = {};
+  stat(buffer2, &executable);
+  auto build = std::to_string(executable.st_size) + ":" + std::to_string(executable.st_mtime);
+
   ROOT_DIR = dirname(buffer2);
 
+  auto engine = Verve::Engine::Asm;
+  const char *profilePath = NULL;
+  const char *snapshotPath = NULL;
+  const char *fromSnapshotPath = NULL;
+  bool useRegisters = true;
+  bool useCompactEncoding = false;
+  unsigned jitThreshold = 0;
+  bool printStats = false;
+  bool useCache = true;
+  unsigned optimizationLevel = Verve::Optimizer::DefaultLevel;
+  while (argc > 1 && (strncmp(argv[1], "--", 2) == 0 || strncmp(argv[1], "-O", 2) == 0) && strcmp(argv[1], "--help") != 0) {
+    char *option = argv[1];
+    if (strcmp(option, "-O0") == 0 || strcmp(option, "-O1") == 0 || strcmp(option, "-O2") == 0) {
+      optimizationLevel = option[2] - '0';
+    } else if (strcmp(option, "--engine=asm") == 0) {
+      engine = Verve::Engine::Asm;
+    } else if (strcmp(option, "--engine=cxx") == 0) {
+      engine = Verve::Engine::Cxx;
+    } else if (strcmp(option, "--bytecode=register") == 0) {
+      useRegisters = true;
+    } else if (strcmp(option, "--bytecode=stack") == 0) {
+      useRegisters = false;
+    } else if (strcmp(option, "--encoding=wide") == 0) {
+      useCompactEncoding = false;
+    } else if (strcmp(option, "--encoding=compact") == 0) {
+      useCompactEncoding = true;
+    } else if (strcmp(option, "--jit") == 0) {
+      jitThreshold = Verve::Jit::DefaultThreshold;
+    } else if (strncmp(option, "--jit=", 6) == 0 && atoi(option + 6) > 0) {
+      jitThreshold = atoi(option + 6);
+    } else if (strcmp(option, "--stats") == 0) {
+      printStats = true;
+    } else if (strcmp(option, "--no-cache") == 0) {
+      useCache = false;
+    } else if (strncmp(option, "--snapshot=", 11) == 0 && option[11]) {
+      snapshotPath = option + 11;
+    } else if (strncmp(option, "--from-snapshot=", 16) == 0 && option[16]) {
+      fromSnapshotPath = option + 16;
+    } else if (strncmp(option, "--profile-opcodes=", 18) == 0) {
+      profilePath = option + 18;
+    } else {
+      printUsage();
+      return EXIT_FAILURE;
+    }
+    argv++;
+    argc--;
+  }
+
+  if (profilePath) {
+    engine = Verve::Engine::Cxx;
+  }
+  if (engine != Verve::Engine::Asm) {
+    jitThreshold = 0;
+  }
+
+  if (fromSnapshotPath) {
+    if (argc > 2) {
+      printUsage();
+      return EXIT_FAILURE;
+    }
+    auto entry = argc == 2 ? argv[1] : "main";
+    return runSnapshot(fromSnapshotPath, entry, engine, jitThreshold, printStats) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   char *first = argv[1];
   bool isDebug = first && strcmp(first, "-d") == 0;
   bool isCompile = first && strcmp(first, "-c") == 0;
@@ -62,6 +245,51 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
+  // Bytecode is position independent and never written, so the file is
+  // mapped read-only and its pages are only loaded as they are touched, and
+  // shared by every process running it
+  if (isBytecode) {
+    struct stat info;
+    fstat(fileno(source), &info);
+    size_t size = info.st_size;
+    void *bytecode = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(source), 0) : MAP_FAILED;
+    fclose(source);
+    if (bytecode == MAP_FAILED) {
+      printf("Error: Cannot read bytecode from `%s`\n", filename);
+      return EXIT_FAILURE;
+    }
+
+    auto success = run((const uint8_t *)bytecode, size, engine, jitThreshold, profilePath, printStats, snapshotPath);
+    munmap(bytecode, size);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // Programs run from source are cached, unless profiling, since the
+  // profile is collected from bytecode without superinstructions
+  useCache = useCache && !isDebug && !isCompile && !profilePath;
+  char realFilename[PATH_MAX];
+  realpath(filename, realFilename);
+  auto configuration =
+    "-O" + std::to_string(optimizationLevel) +
+    (useRegisters ? " --bytecode=register" : " --bytecode=stack") +
+    (useCompactEncoding ? " --encoding=compact" : " --encoding=wide") +
+    (jitThreshold ? " --jit " : " ") +
+    build;
+  Verve::BytecodeCache cache(realFilename, configuration);
+
+  if (useCache) {
+    size_t size;
+    if (auto bytecode = cache.lookup(size)) {
+      fclose(source);
+      auto success = run(bytecode, size, engine, jitThreshold, profilePath, printStats, snapshotPath);
+      if (printStats) {
+        cache.printStats(stderr);
+      }
+      return success ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
   fseek(source, 0, SEEK_END);
   size_t sourceSize = ftell(source);
   fseek(source, 0, SEEK_SET);
@@ -72,20 +300,23 @@ int main(int argc, char **argv) {
 
   fclose(source);
 
-  if (isBytecode) {
-    Verve::VM vm((uint8_t *)input, sourceSize, true);
-    vm.execute();
-    free(input);
-    return EXIT_SUCCESS;
-  }
-
-  auto dir = dirname(filename);
+  // dirname may modify its argument in place, so keep `filename` intact
+  std::string path = filename;
+  std::string dir = dirname(&path[0]);
 
   Verve::Lexer lexer(filename, input);
   Verve::Parser parser(lexer, dir);
   std::shared_ptr<Verve::AST::Program> ast = parser.parse();
 
-  Verve::Generator generator(ast, !isDebug && !isCompile);
+  Verve::Optimizer optimizer(ast, optimizationLevel);
+  optimizer.optimize();
+
+  Verve::Generator generator(ast);
+  generator.m_useSuperinstructions = !profilePath;
+  generator.m_useRegisters = useRegisters;
+  generator.m_countCalls = jitThreshold > 0;
+  generator.m_usePeephole = optimizationLevel >= 1;
+  generator.m_useCompactEncoding = useCompactEncoding;
   auto &bytecode = generator.generate();
 
   if (isDebug) {
@@ -96,8 +327,19 @@ int main(int argc, char **argv) {
     output << bytecode.str();
   } else {
     auto bc = bytecode.str();
-    Verve::VM vm((uint8_t *)bc.data(), bc.size());
-    vm.execute();
+    if (useCache) {
+      auto dependencies = Verve::parsedFiles();
+      dependencies.push_back(realFilename);
+      cache.store(bc, dependencies, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    auto success = run((const uint8_t *)bc.data(), bc.size(), engine, jitThreshold, profilePath, printStats, snapshotPath);
+    if (printStats && useCache) {
+      cache.printStats(stderr);
+    }
+    if (!success) {
+      free(input);
+      return EXIT_FAILURE;
+    }
   }
 
   free(input);